@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Size of the test file */
+#define FILE_SIZE (16 * 1024 * 1024)
+/* Size of a single request, one block */
+#define REQ_SIZE 4096
+/* Requests issued by each run */
+#define NREQS 4096
+/* Largest queue depth tried */
+#define MAX_DEPTH 16
+/* Blocks kept by the block cache, small so that reads go to the disk */
+#define CACHE_BLOCKS 16
+
+static atomic_int writes_done;
+
+/* Byte at @offset of the test file */
+static uint8_t pattern(size_t offset)
+{
+	return (uint8_t)(offset * 13 + (offset >> 12));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const uint8_t *buf, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		ASSERT(buf[i] == pattern(offset + i), "content");
+}
+
+/* Offset of the next random request */
+static size_t random_offset(void)
+{
+	return (size_t)(rand() % (FILE_SIZE / REQ_SIZE)) * REQ_SIZE;
+}
+
+/* Write the whole file back from the page cache and drop it from there, so
+ * that the next reads really go to the storage holding the disk image */
+static void drop_caches(const char *diskname)
+{
+	int fd;
+
+	ASSERT(!fs_sync(), "fs_sync");
+	fd = open(diskname, O_RDONLY);
+	ASSERT(fd >= 0, "open");
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static void write_done(struct fs_aio *req)
+{
+	ASSERT(req->result == REQ_SIZE, "fs_aio_submit");
+	atomic_fetch_add(&writes_done, 1);
+}
+
+/* Rewrite the file with asynchronous writes completed by a callback */
+static void async_fill(int fd)
+{
+	static uint8_t bufs[FILE_SIZE / REQ_SIZE][REQ_SIZE];
+	static struct fs_aio reqs[FILE_SIZE / REQ_SIZE];
+	int n = FILE_SIZE / REQ_SIZE;
+
+	for (int i = 0; i < n; i++) {
+		for (size_t k = 0; k < REQ_SIZE; k++)
+			bufs[i][k] = pattern(i * REQ_SIZE + k);
+		reqs[i] = (struct fs_aio) {
+			.op = FS_AIO_WRITE,
+			.fd = fd,
+			.buf = bufs[i],
+			.count = REQ_SIZE,
+			.offset = i * REQ_SIZE,
+			.callback = write_done,
+		};
+		ASSERT(!fs_aio_submit(&reqs[i]), "fs_aio_submit");
+	}
+	while (writes_done < n)
+		usleep(1000);
+}
+
+/* Random reads with fs_pread(), one at a time. Returns requests per second */
+static double sync_reads(int fd)
+{
+	uint8_t buf[REQ_SIZE];
+	double start = now();
+
+	for (int i = 0; i < NREQS; i++) {
+		size_t offset = random_offset();
+
+		ASSERT(fs_pread(fd, buf, REQ_SIZE, offset) == REQ_SIZE,
+		       "fs_pread");
+		check(buf, offset, REQ_SIZE);
+	}
+
+	return NREQS / (now() - start);
+}
+
+/* Random reads keeping @depth requests in flight, each one on its own file
+ * descriptor. Returns requests per second */
+static double async_reads(const int *fds, int depth)
+{
+	static uint8_t bufs[MAX_DEPTH][REQ_SIZE];
+	struct fs_aio reqs[MAX_DEPTH];
+	struct fs_aio *done[MAX_DEPTH];
+	int submitted = 0, completed = 0;
+	double start = now();
+
+	for (int i = 0; i < depth; i++) {
+		reqs[i] = (struct fs_aio) {
+			.op = FS_AIO_READ,
+			.fd = fds[i],
+			.buf = bufs[i],
+			.count = REQ_SIZE,
+			.offset = random_offset(),
+		};
+		ASSERT(!fs_aio_submit(&reqs[i]), "fs_aio_submit");
+		submitted++;
+	}
+
+	while (completed < NREQS) {
+		int n = fs_aio_reap(1, depth, done);
+
+		ASSERT(n > 0, "fs_aio_reap");
+		for (int i = 0; i < n; i++) {
+			struct fs_aio *req = done[i];
+
+			ASSERT(req->result == REQ_SIZE, "fs_aio_submit");
+			check(req->buf, req->offset, REQ_SIZE);
+			completed++;
+			if (submitted == NREQS)
+				continue;
+			req->offset = random_offset();
+			ASSERT(!fs_aio_submit(req), "fs_aio_submit");
+			submitted++;
+		}
+	}
+
+	return NREQS / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[REQ_SIZE];
+	int fds[MAX_DEPTH];
+	struct fs_stats stats;
+	double base;
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage> [window_us]\n", argv[0]);
+		exit(1);
+	}
+
+	/* Optional batching window of the disk request scheduler */
+	if (argc > 2)
+		ASSERT(!fs_set_sched_window(atoi(argv[2])),
+		       "fs_set_sched_window");
+
+	ASSERT(!fs_set_cache_size(CACHE_BLOCKS), "fs_set_cache_size");
+	ASSERT(!fs_set_aio_threads(MAX_DEPTH), "fs_set_aio_threads");
+	ASSERT(!fs_set_readahead(0), "fs_set_readahead");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+
+	/* Files can't have holes: allocate the file, then fill it
+	 * asynchronously */
+	ASSERT(!fs_create("aio"), "fs_create");
+	for (int i = 0; i < MAX_DEPTH; i++) {
+		fds[i] = fs_open("aio");
+		ASSERT(fds[i] >= 0, "fs_open");
+	}
+	for (size_t offset = 0; offset < FILE_SIZE; offset += REQ_SIZE)
+		ASSERT(fs_write(fds[0], buf, REQ_SIZE) == REQ_SIZE, "fs_write");
+	async_fill(fds[0]);
+
+	srand(1);
+	drop_caches(argv[1]);
+	base = sync_reads(fds[0]);
+	printf("depth  requests/s  speedup\n");
+	printf(" sync  %10.0f  %6.2fx\n", base, 1.0);
+	for (int depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+		double rate;
+
+		drop_caches(argv[1]);
+		rate = async_reads(fds, depth);
+		printf("%5d  %10.0f  %6.2fx\n", depth, rate, rate / base);
+	}
+
+	ASSERT(!fs_stats(&stats), "fs_stats");
+	if (stats.disk_requests)
+		printf("disk requests %llu, merged into %llu transfers\n",
+		       (unsigned long long)stats.disk_requests,
+		       (unsigned long long)stats.disk_transfers);
+
+	for (int i = 0; i < MAX_DEPTH; i++)
+		ASSERT(!fs_close(fds[i]), "fs_close");
+	ASSERT(!fs_delete("aio"), "fs_delete");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Size of the test file */
+#define FILE_SIZE (64 * 1024 * 1024)
+/* Size of a sequential request */
+#define SEQ_SIZE (1024 * 1024)
+/* Size of a random read, and number of them */
+#define RAND_SIZE 4096
+#define NREQS 2048
+/* Memory given to the block cache, whatever the block size */
+#define CACHE_BYTES (4 * 1024 * 1024)
+
+/* Byte at @offset of the test file */
+static uint8_t pattern(size_t offset)
+{
+	return (uint8_t)(offset * 13 + (offset >> 12));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const uint8_t *buf, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		ASSERT(buf[i] == pattern(offset + i), "content");
+}
+
+/* Write the whole file back from the page cache and drop it from there, so
+ * that the next reads really go to the storage holding the disk image */
+static void drop_caches(const char *diskname)
+{
+	int fd;
+
+	ASSERT(!fs_sync(), "fs_sync");
+	fd = open(diskname, O_RDONLY);
+	ASSERT(fd >= 0, "open");
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/* Write the file sequentially, down to the disk image. Returns MB/s */
+static double seq_write(const char *diskname, int fd, uint8_t *buf)
+{
+	double start = now();
+
+	for (size_t offset = 0; offset < FILE_SIZE; offset += SEQ_SIZE) {
+		for (size_t k = 0; k < SEQ_SIZE; k++)
+			buf[k] = pattern(offset + k);
+		ASSERT(fs_write(fd, buf, SEQ_SIZE) == SEQ_SIZE, "fs_write");
+	}
+	drop_caches(diskname);
+
+	return FILE_SIZE / (now() - start) / 1e6;
+}
+
+/* Read the file sequentially. Returns MB/s */
+static double seq_read(int fd, uint8_t *buf)
+{
+	double start = now();
+
+	ASSERT(!fs_lseek(fd, 0), "fs_lseek");
+	for (size_t offset = 0; offset < FILE_SIZE; offset += SEQ_SIZE)
+		ASSERT(fs_read(fd, buf, SEQ_SIZE) == SEQ_SIZE, "fs_read");
+
+	return FILE_SIZE / (now() - start) / 1e6;
+}
+
+/* Small reads at random offsets. Returns requests per second */
+static double rand_reads(int fd)
+{
+	uint8_t buf[RAND_SIZE];
+	double start = now();
+
+	for (int i = 0; i < NREQS; i++) {
+		size_t offset = (size_t)(rand() % (FILE_SIZE / RAND_SIZE)) *
+				RAND_SIZE;
+
+		ASSERT(fs_pread(fd, buf, RAND_SIZE, offset) == RAND_SIZE,
+		       "fs_pread");
+		check(buf, offset, RAND_SIZE);
+	}
+
+	return NREQS / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_format_options opts;
+	struct fs_stats stats;
+	uint8_t *buf;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <scratch diskimage>\n", argv[0]);
+		exit(1);
+	}
+
+	buf = malloc(SEQ_SIZE);
+	ASSERT(buf, "malloc");
+
+	printf("block size  write MB/s  read MB/s  random reads/s  mount us\n");
+	for (size_t bs = FS_BLOCK_SIZE_MIN; bs <= FS_BLOCK_SIZE_MAX; bs *= 2) {
+		double write_rate, read_rate, rand_rate;
+
+		/* Room for the file, plus a little slack */
+		fs_format_init(&opts);
+		opts.version = FS_VERSION_2;
+		opts.block_size = bs;
+		ASSERT(!fs_format(argv[1], FILE_SIZE / bs + 16, &opts),
+		       "fs_format");
+
+		ASSERT(!fs_set_cache_size(CACHE_BYTES / bs), "fs_set_cache_size");
+		ASSERT(!fs_mount(argv[1]), "fs_mount");
+		ASSERT(!fs_stats(&stats), "fs_stats");
+		ASSERT(!fs_create("bench"), "fs_create");
+		fd = fs_open("bench");
+		ASSERT(fd >= 0, "fs_open");
+
+		write_rate = seq_write(argv[1], fd, buf);
+		drop_caches(argv[1]);
+		read_rate = seq_read(fd, buf);
+		check(buf, FILE_SIZE - SEQ_SIZE, SEQ_SIZE);
+		srand(1);
+		drop_caches(argv[1]);
+		rand_rate = rand_reads(fd);
+
+		printf("%10zu  %10.1f  %9.1f  %14.0f  %8.0f\n", bs, write_rate,
+		       read_rate, rand_rate, stats.mount_time_ns / 1e3);
+
+		ASSERT(!fs_close(fd), "fs_close");
+		ASSERT(!fs_umount(), "fs_umount");
+	}
+
+	free(buf);
+	unlink(argv[1]);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Block size of the version 1 disks used */
+#define BLK 4096
+/* Blocks buffered by delayed allocation before they are flushed */
+#define DELALLOC_BLOCKS 64
+/* Data blocks of the disk filled by fill_disk() */
+#define SMALL_DISK_BLOCKS 40
+
+/* Byte at @offset of file @file */
+static uint8_t pattern(int file, size_t offset)
+{
+	return (uint8_t)(offset * 13 + (offset >> 12) + file * 101);
+}
+
+static void fill(uint8_t *buf, int file, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = pattern(file, offset + i);
+}
+
+/* Check that @name holds @size bytes of the pattern of @file */
+static void check_file(const char *name, int file, size_t size)
+{
+	uint8_t *buf = malloc(size + 1);
+	int fd;
+
+	ASSERT(buf, "malloc");
+	fd = fs_open(name);
+	ASSERT(fd >= 0, "fs_open");
+	ASSERT(fs_stat(fd) == (int)size, "fs_stat");
+	ASSERT(fs_read(fd, buf, size + 1) == (int)size, "fs_read");
+	for (size_t i = 0; i < size; i++)
+		ASSERT(buf[i] == pattern(file, i), "content");
+	ASSERT(!fs_close(fd), "fs_close");
+	free(buf);
+}
+
+/* An aligned multi-block write that runs past the end of the FAT chain,
+ * while the blocks after it are buffered, must not take a datablock for a
+ * block that is already buffered */
+static void write_across_chain_end(const char *diskname)
+{
+	uint8_t buf[3 * BLK];
+	int fd;
+
+	ASSERT(!fs_format(diskname, 100, NULL), "fs_format");
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	ASSERT(!fs_create("file"), "fs_create");
+
+	/* Two blocks in the chain */
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	fill(buf, 0, 0, 2 * BLK);
+	ASSERT(fs_write(fd, buf, 2 * BLK) == 2 * BLK, "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	/* Blocks 2 to 4 buffered, then blocks 0 to 2 rewritten at once */
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	fill(buf, 0, 2 * BLK, 3 * BLK);
+	ASSERT(fs_pwrite(fd, buf, 3 * BLK, 2 * BLK) == 3 * BLK, "fs_pwrite");
+	fill(buf, 0, 0, 3 * BLK);
+	ASSERT(fs_pwrite(fd, buf, 3 * BLK, 0) == 3 * BLK, "fs_pwrite");
+	ASSERT(!fs_close(fd), "fs_close");
+
+	check_file("file", 0, 5 * BLK);
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	check_file("file", 0, 5 * BLK);
+	ASSERT(!fs_umount(), "fs_umount");
+}
+
+/* A small file only puts its own bytes in its datablock: the rest of the
+ * buffered block is written as zeros */
+static void no_stray_bytes(const char *diskname)
+{
+	uint8_t buf[BLK];
+	uint16_t data_start;
+	size_t n_nonzero = 0;
+	FILE *disk;
+	int fd;
+
+	ASSERT(!fs_format(diskname, 100, NULL), "fs_format");
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	ASSERT(!fs_create("file"), "fs_create");
+	fd = fs_open("file");
+	ASSERT(fd >= 0, "fs_open");
+	fill(buf, 0, 0, 5);
+	ASSERT(fs_write(fd, buf, 5) == 5, "fs_write");
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_umount(), "fs_umount");
+
+	/* Datablocks start at the block given by the superblock */
+	disk = fopen(diskname, "rb");
+	ASSERT(disk, "fopen");
+	ASSERT(fseek(disk, 12, SEEK_SET) == 0, "fseek");
+	ASSERT(fread(&data_start, sizeof(data_start), 1, disk) == 1, "fread");
+	ASSERT(fseek(disk, (long)data_start * BLK, SEEK_SET) == 0, "fseek");
+	while (fread(buf, BLK, 1, disk) == 1)
+		for (size_t i = 0; i < BLK; i++)
+			n_nonzero += buf[i] != 0;
+	fclose(disk);
+	ASSERT(n_nonzero <= 5, "content");
+}
+
+/* Two files growing at the same time until the disk is full: the blocks
+ * buffered for one of them can't be given to the other one, so everything
+ * the writes reported as written reaches the disk */
+static void fill_disk(const char *diskname)
+{
+	uint8_t buf[BLK + BLK / 2];
+	size_t size[2] = { 0, 0 };
+	const char *names[2] = { "a", "b" };
+	int fd[2];
+
+	ASSERT(!fs_format(diskname, SMALL_DISK_BLOCKS, NULL), "fs_format");
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	for (int f = 0; f < 2; f++) {
+		ASSERT(!fs_create(names[f]), "fs_create");
+		fd[f] = fs_open(names[f]);
+		ASSERT(fd[f] >= 0, "fs_open");
+	}
+
+	/* Aligned and unaligned writes, until neither file grows */
+	for (int i = 0, full = 0; full < 2; i++) {
+		int f = i % 2;
+		size_t len = (i % 3) ? sizeof(buf) : BLK;
+		int ret;
+
+		fill(buf, f, size[f], len);
+		ret = fs_write(fd[f], buf, len);
+		ASSERT(ret >= 0, "fs_write");
+		size[f] += ret;
+		full = ret == 0 ? full + 1 : 0;
+	}
+	for (int f = 0; f < 2; f++)
+		ASSERT(!fs_close(fd[f]), "fs_close");
+	ASSERT(size[0] + size[1] > (SMALL_DISK_BLOCKS - 3) * BLK, "fs_write");
+
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(diskname), "fs_mount");
+	for (int f = 0; f < 2; f++)
+		check_file(names[f], f, size[f]);
+	ASSERT(!fs_umount(), "fs_umount");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		printf("Usage: %s <scratch diskimage>\n", argv[0]);
+		exit(1);
+	}
+
+	ASSERT(!fs_set_delayed_alloc(DELALLOC_BLOCKS), "fs_set_delayed_alloc");
+	write_across_chain_end(argv[1]);
+	no_stray_bytes(argv[1]);
+	fill_disk(argv[1]);
+	unlink(argv[1]);
+
+	printf("Delayed allocation tests passed\n");
+	return 0;
+}
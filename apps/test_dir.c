@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Number of files, and how many are created between two reports */
+#define NFILES 100000
+#define STEP 10000
+/* Room for the directory blocks, files stay empty */
+#define DATA_BLOCKS 4096
+/* Directories above the file of the deep path lookups */
+#define DEPTH 16
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_name(char *name, int i)
+{
+	snprintf(name, FS_FILENAME_LEN, "file%07d", i);
+}
+
+/* Open and close the file at @path NFILES times. Returns lookups/s */
+static double deep_lookups(const char *path)
+{
+	double start = now();
+
+	for (int i = 0; i < NFILES; i++) {
+		int fd = fs_open(path);
+
+		ASSERT(fd >= 0, "fs_open");
+		ASSERT(!fs_close(fd), "fs_close");
+	}
+
+	return NFILES / (now() - start);
+}
+
+/* Open and close every file, in the order of @perm. Returns lookups/s */
+static double lookups(const int *perm)
+{
+	char name[FS_FILENAME_LEN];
+	double start = now();
+
+	for (int i = 0; i < NFILES; i++) {
+		int fd;
+
+		file_name(name, perm[i]);
+		fd = fs_open(name);
+		ASSERT(fd >= 0, "fs_open");
+		ASSERT(!fs_close(fd), "fs_close");
+	}
+
+	return NFILES / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_format_options opts;
+	struct fs_stats stats;
+	char name[FS_FILENAME_LEN];
+	char path[DEPTH * FS_FILENAME_LEN];
+	int *perm;
+	double start;
+
+	if (argc < 2) {
+		printf("Usage: %s <scratch diskimage>\n", argv[0]);
+		exit(1);
+	}
+
+	/* Files are looked up in a random order */
+	perm = malloc(NFILES * sizeof(int));
+	ASSERT(perm, "malloc");
+	for (int i = 0; i < NFILES; i++)
+		perm[i] = i;
+	srand(1);
+	for (int i = NFILES - 1; i > 0; i--) {
+		int j = rand() % (i + 1), tmp = perm[i];
+
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+
+	fs_format_init(&opts);
+	opts.version = FS_VERSION_2;
+	ASSERT(!fs_format(argv[1], DATA_BLOCKS, &opts), "fs_format");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+
+	/* The rate must not drop as the directory grows */
+	printf("    files  creates/s\n");
+	for (int i = 0; i < NFILES; i += STEP) {
+		start = now();
+		for (int k = i; k < i + STEP; k++) {
+			file_name(name, k);
+			ASSERT(!fs_create(name), "fs_create");
+		}
+		printf("%9d  %9.0f\n", i + STEP, STEP / (now() - start));
+	}
+
+	start = now();
+	ASSERT(!fs_sync(), "fs_sync");
+	printf("sync: %.1f ms\n", (now() - start) * 1e3);
+	printf("lookups/s: %.0f\n", lookups(perm));
+
+	ASSERT(!fs_umount(), "fs_umount");
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+	ASSERT(!fs_stats(&stats), "fs_stats");
+	printf("mount: %.1f ms\n", stats.mount_time_ns / 1e6);
+	printf("lookups/s after mount: %.0f\n", lookups(perm));
+
+	/* A path costs a lookup per directory, the disk is not read */
+	path[0] = '\0';
+	for (int d = 0; d < DEPTH; d++) {
+		sprintf(path + strlen(path), "%sdir%02d", d ? "/" : "", d);
+		ASSERT(!fs_mkdir(path), "fs_mkdir");
+	}
+	strcat(path, "/file");
+	ASSERT(!fs_create(path), "fs_create");
+	printf("depth %d lookups/s: %.0f\n", DEPTH, deep_lookups(path));
+
+	start = now();
+	for (int i = 0; i < NFILES; i++) {
+		file_name(name, perm[i]);
+		ASSERT(!fs_delete(name), "fs_delete");
+	}
+	printf("deletes/s: %.0f\n", NFILES / (now() - start));
+
+	ASSERT(!fs_umount(), "fs_umount");
+	free(perm);
+	unlink(argv[1]);
+
+	return 0;
+}
@@ -112,6 +112,16 @@ void thread_fs_script(void *arg)
 
 			printf("CREATE successful.\n");
 
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
 
@@ -398,6 +408,31 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <path>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", path);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,6 +534,32 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_format_options opts;
+	char *diskname;
+	size_t data_blocks;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [<version> [<block size>]]");
+
+	diskname = t_arg->argv[0];
+	data_blocks = strtoul(t_arg->argv[1], NULL, 0);
+
+	fs_format_init(&opts);
+	if (t_arg->argc > 2)
+		opts.version = atoi(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		opts.block_size = strtoul(t_arg->argv[3], NULL, 0);
+
+	if (fs_format(diskname, data_blocks, &opts))
+		die("Cannot format diskname");
+
+	printf("Formatted '%s' (version %d, %zu data blocks of %zu bytes)\n",
+	       diskname, opts.version, data_blocks, opts.block_size);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -515,9 +576,11 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "format",	thread_fs_format }
 };
 
 void usage(char *program)
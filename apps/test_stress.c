@@ -0,0 +1,267 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Size of every test file */
+#define FILE_SIZE (512 * 1024)
+/* Size of a single write */
+#define CHUNK_SIZE 4096
+/* Size of a single read, not aligned on blocks so that the block cache and
+ * readahead are involved */
+#define READ_SIZE 1000
+/* Times each reader goes through its file */
+#define ROUNDS 8
+/* Largest number of threads tried */
+#define MAX_THREADS 16
+
+struct reader {
+	pthread_t thread;
+	/* File to read, and region of it when the FD is shared */
+	int fd;
+	int file;
+	size_t start, len;
+	int shared;
+	size_t bytes;
+};
+
+static atomic_int writer_done;
+
+/* Byte at @offset of test file @file */
+static uint8_t pattern(int file, size_t offset)
+{
+	return (uint8_t)(file * 31 + offset * 7 + (offset >> 12));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(const uint8_t *buf, int file, size_t offset, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		ASSERT(buf[i] == pattern(file, offset + i), "content");
+}
+
+/* Read a whole file, or a region of a shared FD, ROUNDS times */
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	uint8_t buf[READ_SIZE];
+
+	for (int round = 0; round < ROUNDS; round++) {
+		size_t offset = r->start;
+
+		if (!r->shared)
+			ASSERT(!fs_lseek(r->fd, offset), "fs_lseek");
+		while (offset < r->start + r->len) {
+			size_t len = r->start + r->len - offset;
+			int ret;
+
+			if (len > READ_SIZE)
+				len = READ_SIZE;
+			if (r->shared)
+				ret = fs_pread(r->fd, buf, len, offset);
+			else
+				ret = fs_read(r->fd, buf, len);
+			ASSERT(ret == (int)len, "fs_read");
+			check(buf, r->file, offset, len);
+			offset += len;
+			r->bytes += len;
+		}
+	}
+
+	return NULL;
+}
+
+/* Keep rewriting the last file while readers run */
+static void *writer_thread(void *arg)
+{
+	int file = *(int *)arg;
+	uint8_t buf[CHUNK_SIZE];
+	char filename[FS_FILENAME_LEN];
+	int fd;
+
+	snprintf(filename, sizeof(filename), "stress%d", file);
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+	while (!writer_done) {
+		size_t offset = (rand() % (FILE_SIZE / CHUNK_SIZE)) * CHUNK_SIZE;
+
+		for (size_t i = 0; i < CHUNK_SIZE; i++)
+			buf[i] = pattern(file, offset + i);
+		ASSERT(fs_pwrite(fd, buf, CHUNK_SIZE, offset) == CHUNK_SIZE,
+		       "fs_pwrite");
+	}
+	ASSERT(!fs_close(fd), "fs_close");
+
+	return NULL;
+}
+
+/*
+ * Run @n readers and return the throughput in MB/s. Each reader gets its own
+ * file, unless @shared is set, in which case they all read their part of
+ * file 0 through a single FD with fs_pread().
+ */
+static double run_readers(int n, int shared, int with_writer)
+{
+	struct reader readers[MAX_THREADS];
+	pthread_t writer;
+	int writer_file = MAX_THREADS;
+	int shared_fd = -1;
+	size_t bytes = 0;
+	double start, elapsed;
+
+	if (shared) {
+		shared_fd = fs_open("stress0");
+		ASSERT(shared_fd >= 0, "fs_open");
+	}
+
+	for (int i = 0; i < n; i++) {
+		char filename[FS_FILENAME_LEN];
+		struct reader *r = &readers[i];
+
+		memset(r, 0, sizeof(*r));
+		r->shared = shared;
+		if (shared) {
+			r->fd = shared_fd;
+			r->file = 0;
+			r->start = FILE_SIZE / n * i;
+			r->len = FILE_SIZE / n;
+		} else {
+			snprintf(filename, sizeof(filename), "stress%d", i);
+			r->fd = fs_open(filename);
+			ASSERT(r->fd >= 0, "fs_open");
+			r->file = i;
+			r->len = FILE_SIZE;
+		}
+	}
+
+	writer_done = 0;
+	if (with_writer)
+		ASSERT(!pthread_create(&writer, NULL, writer_thread,
+				       &writer_file), "pthread_create");
+
+	start = now();
+	for (int i = 0; i < n; i++)
+		ASSERT(!pthread_create(&readers[i].thread, NULL, reader_thread,
+				       &readers[i]), "pthread_create");
+	for (int i = 0; i < n; i++) {
+		pthread_join(readers[i].thread, NULL);
+		bytes += readers[i].bytes;
+	}
+	elapsed = now() - start;
+
+	writer_done = 1;
+	if (with_writer)
+		pthread_join(writer, NULL);
+
+	for (int i = 0; i < n; i++)
+		if (!shared)
+			ASSERT(!fs_close(readers[i].fd), "fs_close");
+	if (shared)
+		ASSERT(!fs_close(shared_fd), "fs_close");
+
+	return bytes / elapsed / (1 << 20);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[CHUNK_SIZE];
+	int max_threads = 8;
+	double base[3];
+
+	if (argc < 2) {
+		printf("Usage: %s <diskimage> [max threads]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (max_threads < 1 || max_threads > MAX_THREADS) {
+		printf("Between 1 and %d threads\n", MAX_THREADS);
+		exit(1);
+	}
+
+	ASSERT(!fs_mount(argv[1]), "fs_mount");
+
+	/* One file per reader, plus one for the writer */
+	for (int file = 0; file <= MAX_THREADS; file++) {
+		char filename[FS_FILENAME_LEN];
+		int fd;
+
+		if (file >= max_threads && file != MAX_THREADS)
+			continue;
+		snprintf(filename, sizeof(filename), "stress%d", file);
+		ASSERT(!fs_create(filename), "fs_create");
+		fd = fs_open(filename);
+		ASSERT(fd >= 0, "fs_open");
+		for (size_t offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+			for (size_t i = 0; i < CHUNK_SIZE; i++)
+				buf[i] = pattern(file, offset + i);
+			ASSERT(fs_write(fd, buf, CHUNK_SIZE) == CHUNK_SIZE,
+			       "fs_write");
+		}
+		ASSERT(!fs_close(fd), "fs_close");
+	}
+
+	printf("threads  own files  shared fd  with writer  (MB/s, speedup)\n");
+	for (int n = 1; n <= max_threads; n *= 2) {
+		double mbs[3];
+
+		mbs[0] = run_readers(n, 0, 0);
+		mbs[1] = run_readers(n, 1, 0);
+		mbs[2] = run_readers(n, 0, 1);
+		if (n == 1)
+			memcpy(base, mbs, sizeof(base));
+		printf("%7d", n);
+		for (int i = 0; i < 3; i++)
+			printf("  %6.0f %4.2fx", mbs[i], mbs[i] / base[i]);
+		printf("\n");
+	}
+
+	/* Whatever the interleaving, the writer's file must be intact */
+	{
+		char filename[FS_FILENAME_LEN];
+		int fd;
+
+		snprintf(filename, sizeof(filename), "stress%d", MAX_THREADS);
+		fd = fs_open(filename);
+
+		ASSERT(fd >= 0, "fs_open");
+		for (size_t offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+			ASSERT(fs_read(fd, buf, CHUNK_SIZE) == CHUNK_SIZE,
+			       "fs_read");
+			check(buf, MAX_THREADS, offset, CHUNK_SIZE);
+		}
+		ASSERT(!fs_close(fd), "fs_close");
+	}
+
+	for (int file = 0; file <= MAX_THREADS; file++) {
+		char filename[FS_FILENAME_LEN];
+
+		if (file >= max_threads && file != MAX_THREADS)
+			continue;
+		snprintf(filename, sizeof(filename), "stress%d", file);
+		ASSERT(!fs_delete(filename), "fs_delete");
+	}
+	ASSERT(!fs_umount(), "fs_umount");
+
+	return 0;
+}
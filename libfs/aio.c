@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aio.h"
+
+#define aio_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Submitted request */
+struct aio_req {
+	aio_fn fn;
+	void *arg;
+	/* Next request of the same queue */
+	struct aio_req *next;
+};
+
+/* Singly linked FIFO of requests */
+struct aio_queue {
+	struct aio_req *head, *tail;
+};
+
+/* I/O pool instance description */
+struct aio_pool {
+	pthread_t *threads;
+	size_t nthreads;
+	/* Requests not started yet */
+	struct aio_queue pending;
+	/* Requests done, waiting for aio_reap() */
+	struct aio_queue completed;
+	/* Request structures ready for reuse */
+	struct aio_req *free_reqs;
+	/* Requests submitted and not done yet, running or not */
+	size_t in_flight;
+	/* Threads must exit once the pending queue is empty */
+	int stop;
+	/* Protects everything above */
+	pthread_mutex_t lock;
+	/* Signaled when a request is submitted, and on stop */
+	pthread_cond_t work;
+	/* Signaled when a request is done */
+	pthread_cond_t done;
+};
+
+static void queue_push(struct aio_queue *q, struct aio_req *req)
+{
+	req->next = NULL;
+	if (q->tail)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+}
+
+static struct aio_req *queue_pop(struct aio_queue *q)
+{
+	struct aio_req *req = q->head;
+
+	if (req) {
+		q->head = req->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return req;
+}
+
+static void req_free(struct aio_pool *pool, struct aio_req *req)
+{
+	req->next = pool->free_reqs;
+	pool->free_reqs = req;
+}
+
+static void *aio_thread(void *data)
+{
+	struct aio_pool *pool = data;
+	struct aio_req *req;
+	int queued;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!(req = queue_pop(&pool->pending)) && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!req)
+			break;
+
+		/* Requests run in parallel, without the pool lock */
+		pthread_mutex_unlock(&pool->lock);
+		queued = req->fn(req->arg);
+		pthread_mutex_lock(&pool->lock);
+
+		if (queued)
+			queue_push(&pool->completed, req);
+		else
+			req_free(pool, req);
+		pool->in_flight--;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct aio_pool *aio_open(size_t nthreads)
+{
+	struct aio_pool *pool;
+
+	if (!nthreads) {
+		aio_error("no thread to run requests");
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				   aio_thread, pool)) {
+			aio_error("cannot start I/O thread");
+			aio_close(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+int aio_close(struct aio_pool *pool)
+{
+	struct aio_req *req;
+
+	if (!pool) {
+		aio_error("no pool");
+		return -1;
+	}
+
+	/* Threads drain the pending queue before exiting */
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	while ((req = queue_pop(&pool->completed)))
+		free(req);
+	while ((req = pool->free_reqs)) {
+		pool->free_reqs = req->next;
+		free(req);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+
+	return 0;
+}
+
+int aio_submit(struct aio_pool *pool, aio_fn fn, void *arg)
+{
+	struct aio_req *req;
+
+	pthread_mutex_lock(&pool->lock);
+	req = pool->free_reqs;
+	if (req)
+		pool->free_reqs = req->next;
+	else
+		req = malloc(sizeof(*req));
+	if (!req) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	req->fn = fn;
+	req->arg = arg;
+	queue_push(&pool->pending, req);
+	pool->in_flight++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+size_t aio_reap(struct aio_pool *pool, size_t min, size_t max, void **args)
+{
+	struct aio_req *req;
+	size_t n = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (n < max) {
+		req = queue_pop(&pool->completed);
+		if (!req) {
+			/* Nothing can complete if nothing is in flight */
+			if (n >= min || !pool->in_flight)
+				break;
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+		args[n++] = req->arg;
+		req_free(pool, req);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return n;
+}
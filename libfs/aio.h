@@ -0,0 +1,73 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Default number of I/O threads of a pool */
+#define AIO_DEFAULT_THREADS 4
+
+/** Pool of I/O threads running submitted requests (opaque) */
+struct aio_pool;
+
+/**
+ * aio_fn - Request run by an I/O thread
+ * @arg: Argument given to aio_submit()
+ *
+ * Return: non-zero to queue @arg on the completion queue of the pool, where
+ * aio_reap() finds it. 0 if the request took care of its completion itself.
+ */
+typedef int (*aio_fn)(void *arg);
+
+/**
+ * aio_open - Start a pool of I/O threads
+ * @nthreads: Number of threads
+ *
+ * Start @nthreads threads waiting for requests. Requests are started in the
+ * order they are submitted, and up to @nthreads of them run at the same time.
+ *
+ * Return: NULL if @nthreads is 0, or if the pool cannot be allocated or its
+ * threads cannot be started. Otherwise the new pool.
+ */
+struct aio_pool *aio_open(size_t nthreads);
+
+/**
+ * aio_close - Stop a pool of I/O threads
+ * @pool: Pool started by aio_open()
+ *
+ * Wait for every submitted request to be done, then stop the threads and
+ * release the pool. Completions that were not reaped are dropped.
+ *
+ * Return: -1 if @pool is NULL. 0 otherwise.
+ */
+int aio_close(struct aio_pool *pool);
+
+/**
+ * aio_submit - Submit a request
+ * @pool: Pool started by aio_open()
+ * @fn: Function performing the request
+ * @arg: Argument of @fn
+ *
+ * Queue the request and return right away. @fn(@arg) is later called by one
+ * of the I/O threads.
+ *
+ * Return: -1 if the request cannot be queued. 0 otherwise.
+ */
+int aio_submit(struct aio_pool *pool, aio_fn fn, void *arg);
+
+/**
+ * aio_reap - Get completed requests
+ * @pool: Pool started by aio_open()
+ * @min: Number of completions to wait for
+ * @max: Largest number of completions to return
+ * @args: Array of @max entries, filled with the arguments of the requests
+ *
+ * Take up to @max requests off the completion queue, in the order they were
+ * done, waiting until at least @min of them are there. The wait stops early
+ * when no request is left in flight. With @min set to 0, the queue is only
+ * polled.
+ *
+ * Return: the number of entries of @args that were filled.
+ */
+size_t aio_reap(struct aio_pool *pool, size_t min, size_t max, void **args);
+
+#endif /* _AIO_H */
@@ -0,0 +1,683 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of an index list */
+#define NIL -1
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Cached copy of a disk block */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Entry holds a block */
+	uint8_t valid;
+	/* Block was modified since it was read from disk */
+	uint8_t dirty;
+	/* Number of users holding a pointer to the data, see cache_pin() */
+	unsigned int pins;
+	/* Block is being read from disk, without the cache lock held */
+	uint8_t loading;
+	/* LRU list links (head is the most recently used). Pinned entries
+	 * are not on the list, so that they are never evicted */
+	int prev, next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+	/* Block content */
+	uint8_t *data;
+};
+
+/* Block cache instance description */
+struct cache {
+	/* Disk the blocks belong to, and the size of its blocks */
+	struct disk *disk;
+	size_t block_size;
+	/* Number of entries */
+	size_t nblocks;
+	struct cache_entry *entries;
+	uint8_t *data;
+	/* Hash buckets, block number to first entry of the chain */
+	int *buckets;
+	size_t nbuckets;
+	/* LRU list ends */
+	int lru_head, lru_tail;
+	/* Entries with a non-zero pin count */
+	size_t npinned;
+	struct cache_stats stats;
+	/* Protects everything above. Disk reads filling entries are done
+	 * without it, so that threads missing in the cache wait for the disk
+	 * in parallel */
+	pthread_mutex_t lock;
+	/* Signaled when an entry is loaded or unpinned */
+	pthread_cond_t cond;
+};
+
+static size_t bucket_of(struct cache *cache, size_t block)
+{
+	return block & (cache->nbuckets - 1);
+}
+
+static void lru_unlink(struct cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	if (e->prev != NIL)
+		cache->entries[e->prev].next = e->next;
+	else
+		cache->lru_head = e->next;
+	if (e->next != NIL)
+		cache->entries[e->next].prev = e->prev;
+	else
+		cache->lru_tail = e->prev;
+	e->prev = e->next = NIL;
+}
+
+static void lru_push_front(struct cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	e->prev = NIL;
+	e->next = cache->lru_head;
+	if (cache->lru_head != NIL)
+		cache->entries[cache->lru_head].prev = i;
+	cache->lru_head = i;
+	if (cache->lru_tail == NIL)
+		cache->lru_tail = i;
+}
+
+static void lru_push_back(struct cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	e->next = NIL;
+	e->prev = cache->lru_tail;
+	if (cache->lru_tail != NIL)
+		cache->entries[cache->lru_tail].next = i;
+	cache->lru_tail = i;
+	if (cache->lru_head == NIL)
+		cache->lru_head = i;
+}
+
+/* Make unpinned entry @i the most recently used one */
+static void lru_touch(struct cache *cache, int i)
+{
+	if (cache->entries[i].pins)
+		return;
+	lru_unlink(cache, i);
+	lru_push_front(cache, i);
+}
+
+static int hash_lookup(struct cache *cache, size_t block)
+{
+	int i = cache->buckets[bucket_of(cache, block)];
+
+	while (i != NIL && cache->entries[i].block != block)
+		i = cache->entries[i].hnext;
+	return i;
+}
+
+static void hash_insert(struct cache *cache, int i)
+{
+	size_t b = bucket_of(cache, cache->entries[i].block);
+
+	cache->entries[i].hnext = cache->buckets[b];
+	cache->buckets[b] = i;
+}
+
+static void hash_remove(struct cache *cache, int i)
+{
+	int *link = &cache->buckets[bucket_of(cache, cache->entries[i].block)];
+
+	while (*link != i)
+		link = &cache->entries[*link].hnext;
+	*link = cache->entries[i].hnext;
+}
+
+static int writeback(struct cache *cache, struct cache_entry *e)
+{
+	if (disk_write(cache->disk, e->block, e->data) == -1)
+		return -1;
+	e->dirty = 0;
+	cache->stats.writebacks++;
+	return 0;
+}
+
+static void entry_pin(struct cache *cache, int i)
+{
+	if (cache->entries[i].pins++ == 0) {
+		lru_unlink(cache, i);
+		cache->npinned++;
+	}
+}
+
+static void entry_unpin(struct cache *cache, int i)
+{
+	if (--cache->entries[i].pins == 0) {
+		lru_push_front(cache, i);
+		cache->npinned--;
+		pthread_cond_broadcast(&cache->cond);
+	}
+}
+
+/* Return the entry holding @block, once it is loaded, or NIL */
+static int cache_lookup(struct cache *cache, size_t block)
+{
+	int i;
+
+	while ((i = hash_lookup(cache, block)) != NIL &&
+	       cache->entries[i].loading)
+		pthread_cond_wait(&cache->cond, &cache->lock);
+	return i;
+}
+
+/*
+ * Take the least recently used entry for @block, which is not cached, and make
+ * it the most recently used one. Its content is left as is. Invalid entries
+ * are kept at the tail of the LRU list so they get picked before any valid
+ * block is evicted.
+ */
+static int cache_alloc(struct cache *cache, size_t block)
+{
+	int i = cache->lru_tail;
+	struct cache_entry *e;
+
+	if (i == NIL)
+		return NIL;
+
+	e = &cache->entries[i];
+	if (e->valid) {
+		if (e->dirty && writeback(cache, e) == -1)
+			return NIL;
+		hash_remove(cache, i);
+		e->valid = 0;
+		cache->stats.evictions++;
+	}
+
+	e->block = block;
+	e->valid = 1;
+	e->dirty = 0;
+	hash_insert(cache, i);
+	lru_unlink(cache, i);
+	lru_push_front(cache, i);
+	return i;
+}
+
+/* Drop entry @i, whose content is not valid */
+static void cache_drop(struct cache *cache, int i)
+{
+	hash_remove(cache, i);
+	cache->entries[i].valid = 0;
+	cache->entries[i].dirty = 0;
+	lru_unlink(cache, i);
+	lru_push_back(cache, i);
+}
+
+/*
+ * Read the @count blocks held by the entries of @run from disk. The entries
+ * are pinned and marked as loading meanwhile, and the cache lock is released
+ * during the read. Entries are dropped if the read fails.
+ */
+static int cache_load(struct cache *cache, const int *run, int count)
+{
+	struct iovec iov[CACHE_PREFETCH_MAX];
+	int ret;
+
+	for (int k = 0; k < count; k++) {
+		cache->entries[run[k]].loading = 1;
+		entry_pin(cache, run[k]);
+		iov[k].iov_base = cache->entries[run[k]].data;
+		iov[k].iov_len = cache->block_size;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	ret = disk_readv(cache->disk, cache->entries[run[0]].block, iov, count);
+	pthread_mutex_lock(&cache->lock);
+
+	for (int k = 0; k < count; k++) {
+		cache->entries[run[k]].loading = 0;
+		entry_unpin(cache, run[k]);
+		if (ret == -1)
+			cache_drop(cache, run[k]);
+	}
+	pthread_cond_broadcast(&cache->cond);
+
+	return ret;
+}
+
+/*
+ * Return the entry holding @block, loading it from disk if @fill is set, and
+ * make it the most recently used one. Waits when every entry is in use.
+ */
+static int cache_get(struct cache *cache, size_t block, int fill)
+{
+	int i;
+
+	while ((i = cache_lookup(cache, block)) == NIL &&
+	       cache->lru_tail == NIL)
+		pthread_cond_wait(&cache->cond, &cache->lock);
+
+	if (i != NIL) {
+		cache->stats.hits++;
+		lru_touch(cache, i);
+		return i;
+	}
+	cache->stats.misses++;
+
+	i = cache_alloc(cache, block);
+	if (i == NIL)
+		return NIL;
+
+	if (fill && cache_load(cache, &i, 1) == -1)
+		return NIL;
+	return i;
+}
+
+struct cache *cache_open(struct disk *disk, size_t nblocks)
+{
+	struct cache *cache = calloc(1, sizeof(*cache));
+
+	if (!cache)
+		return NULL;
+
+	cache->disk = disk;
+	cache->block_size = disk_block_size(disk);
+	cache->nblocks = nblocks;
+	cache->lru_head = cache->lru_tail = NIL;
+
+	if (nblocks) {
+		/* Power of two buckets, about one per entry */
+		cache->nbuckets = 1;
+		while (cache->nbuckets < nblocks)
+			cache->nbuckets <<= 1;
+
+		cache->entries = calloc(nblocks, sizeof(*cache->entries));
+		cache->data = malloc(nblocks * cache->block_size);
+		cache->buckets = malloc(cache->nbuckets *
+					sizeof(*cache->buckets));
+		if (!cache->entries || !cache->data || !cache->buckets) {
+			free(cache->entries);
+			free(cache->data);
+			free(cache->buckets);
+			free(cache);
+			return NULL;
+		}
+
+		for (size_t b = 0; b < cache->nbuckets; b++)
+			cache->buckets[b] = NIL;
+		for (size_t i = 0; i < nblocks; i++) {
+			cache->entries[i].data = cache->data + i * cache->block_size;
+			lru_push_back(cache, i);
+		}
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+	return cache;
+}
+
+int cache_close(struct cache *cache)
+{
+	int ret;
+
+	if (!cache) {
+		cache_error("no cache currently open");
+		return -1;
+	}
+
+	ret = cache_flush(cache);
+
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->cond);
+	free(cache->entries);
+	free(cache->data);
+	free(cache->buckets);
+	free(cache);
+
+	return ret;
+}
+
+int cache_read(struct cache *cache, size_t block, size_t offset, size_t len,
+	       void *buf)
+{
+	uint8_t *bounce_buf;
+	int i;
+
+	if (!cache->nblocks) {
+		if (offset == 0 && len == cache->block_size)
+			return disk_read(cache->disk, block, buf);
+		bounce_buf = malloc(cache->block_size);
+		if (!bounce_buf ||
+		    disk_read(cache->disk, block, bounce_buf) == -1) {
+			free(bounce_buf);
+			return -1;
+		}
+		memcpy(buf, bounce_buf + offset, len);
+		free(bounce_buf);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	i = cache_get(cache, block, 1);
+	if (i != NIL)
+		memcpy(buf, cache->entries[i].data + offset, len);
+	pthread_mutex_unlock(&cache->lock);
+
+	return i == NIL ? -1 : 0;
+}
+
+int cache_write(struct cache *cache, size_t block, size_t offset, size_t len,
+		const void *buf)
+{
+	uint8_t *bounce_buf;
+	int whole = (offset == 0 && len == cache->block_size);
+	int i;
+
+	if (!cache->nblocks) {
+		if (whole)
+			return disk_write(cache->disk, block, buf);
+		bounce_buf = malloc(cache->block_size);
+		if (!bounce_buf ||
+		    disk_read(cache->disk, block, bounce_buf) == -1) {
+			free(bounce_buf);
+			return -1;
+		}
+		memcpy(bounce_buf + offset, buf, len);
+		i = disk_write(cache->disk, block, bounce_buf);
+		free(bounce_buf);
+		return i;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	i = cache_get(cache, block, !whole);
+	if (i != NIL) {
+		memcpy(cache->entries[i].data + offset, buf, len);
+		cache->entries[i].dirty = 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return i == NIL ? -1 : 0;
+}
+
+int cache_overwrite(struct cache *cache, size_t block, size_t offset,
+		    size_t len, const void *buf)
+{
+	uint8_t *bounce_buf;
+	int i;
+
+	if (!cache->nblocks) {
+		bounce_buf = calloc(1, cache->block_size);
+		if (!bounce_buf)
+			return -1;
+		memcpy(bounce_buf + offset, buf, len);
+		i = disk_write(cache->disk, block, bounce_buf);
+		free(bounce_buf);
+		return i;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	i = cache_lookup(cache, block);
+	if (i == NIL) {
+		i = cache_get(cache, block, 0);
+		if (i != NIL)
+			memset(cache->entries[i].data, 0, cache->block_size);
+	} else {
+		cache->stats.hits++;
+		lru_touch(cache, i);
+	}
+	if (i != NIL) {
+		memcpy(cache->entries[i].data + offset, buf, len);
+		cache->entries[i].dirty = 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return i == NIL ? -1 : 0;
+}
+
+int cache_read_run(struct cache *cache, size_t block, size_t count, void *buf)
+{
+	uint8_t *dst = buf;
+	size_t i = 0;
+	int ret = 0;
+
+	if (!cache->nblocks) {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = count * cache->block_size,
+		};
+		return disk_readv(cache->disk, block, &iov, 1);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	while (i < count) {
+		struct iovec iov;
+		size_t j;
+		int e = cache_lookup(cache, block + i);
+
+		if (e != NIL) {
+			cache->stats.hits++;
+			memcpy(dst + i * cache->block_size, cache->entries[e].data,
+			       cache->block_size);
+			lru_touch(cache, e);
+			i++;
+			continue;
+		}
+
+		/* Gather the following blocks that aren't cached either */
+		for (j = i + 1; j < count; j++)
+			if (hash_lookup(cache, block + j) != NIL)
+				break;
+		cache->stats.misses += j - i;
+
+		/* The blocks are not cached, so nobody can change them while
+		 * they are read without the lock */
+		iov.iov_base = dst + i * cache->block_size;
+		iov.iov_len = (j - i) * cache->block_size;
+		pthread_mutex_unlock(&cache->lock);
+		ret = disk_readv(cache->disk, block + i, &iov, 1);
+		pthread_mutex_lock(&cache->lock);
+		if (ret == -1)
+			break;
+		i = j;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+/* Keep the cached copy of @block, if any, coherent with what is on disk */
+static void cache_refresh(struct cache *cache, size_t block, const void *src)
+{
+	int e = cache_lookup(cache, block);
+
+	if (e == NIL)
+		return;
+	memcpy(cache->entries[e].data, src, cache->block_size);
+	cache->entries[e].dirty = 0;
+}
+
+int cache_write_run(struct cache *cache, size_t block, size_t count,
+		    const void *buf)
+{
+	const uint8_t *src = buf;
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * cache->block_size,
+	};
+
+	if (disk_writev(cache->disk, block, &iov, 1) == -1)
+		return -1;
+
+	if (!cache->nblocks)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < count; i++)
+		cache_refresh(cache, block + i, src + i * cache->block_size);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+int cache_writev(struct cache *cache, size_t block, const struct iovec *iov,
+		 int iovcnt)
+{
+	if (disk_writev(cache->disk, block, iov, iovcnt) == -1)
+		return -1;
+
+	if (!cache->nblocks)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < iovcnt; i++)
+		cache_refresh(cache, block + i, iov[i].iov_base);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void cache_invalidate(struct cache *cache, size_t block)
+{
+	int i;
+
+	if (!cache->nblocks)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	i = cache_lookup(cache, block);
+	if (i != NIL) {
+		/* Someone still looks at the data, only drop the pending
+		 * write */
+		if (cache->entries[i].pins)
+			cache->entries[i].dirty = 0;
+		else
+			cache_drop(cache, i);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_prefetch(struct cache *cache, size_t block, size_t count)
+{
+	int run[CACHE_PREFETCH_MAX];
+	size_t i = 0;
+	int ret = 0;
+
+	if (!cache->nblocks)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	/* Leave room for the blocks being used */
+	count = MIN(count, (cache->nblocks - cache->npinned) / 2);
+	count = MIN(count, CACHE_PREFETCH_MAX);
+
+	while (i < count && ret == 0) {
+		size_t j;
+
+		if (hash_lookup(cache, block + i) != NIL) {
+			i++;
+			continue;
+		}
+
+		/* Load the following blocks that aren't cached either with a
+		 * single request */
+		for (j = i; j < count && hash_lookup(cache, block + j) == NIL;
+		     j++) {
+			run[j - i] = cache_alloc(cache, block + j);
+			if (run[j - i] == NIL) {
+				ret = -1;
+				break;
+			}
+		}
+		if (j > i && cache_load(cache, run, j - i) == -1)
+			ret = -1;
+		else
+			cache->stats.prefetches += j - i;
+		i = j;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_contains(struct cache *cache, size_t block)
+{
+	int ret;
+
+	if (!cache->nblocks)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	ret = hash_lookup(cache, block) != NIL;
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+const void *cache_pin(struct cache *cache, size_t block, int load)
+{
+	const void *data = NULL;
+	int i;
+
+	if (!cache->nblocks)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	if (load) {
+		i = cache_get(cache, block, 1);
+	} else {
+		i = cache_lookup(cache, block);
+		if (i != NIL)
+			cache->stats.hits++;
+	}
+
+	/* Always leave one entry to load other blocks into */
+	if (i != NIL && (cache->entries[i].pins ||
+			 cache->npinned + 1 < cache->nblocks)) {
+		entry_pin(cache, i);
+		data = cache->entries[i].data;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return data;
+}
+
+void cache_unpin(struct cache *cache, const void *data)
+{
+	int i = ((const uint8_t *)data - cache->data) / cache->block_size;
+
+	pthread_mutex_lock(&cache->lock);
+	entry_unpin(cache, i);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_flush(struct cache *cache)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < cache->nblocks && ret == 0; i++) {
+		struct cache_entry *e = &cache->entries[i];
+
+		if (e->valid && !e->loading && e->dirty)
+			ret = writeback(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
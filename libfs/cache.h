@@ -0,0 +1,236 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec definition */
+
+#include "disk.h"
+
+/** Default number of blocks held by the block cache */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/** Maximum number of blocks loaded by a single cache_prefetch() */
+#define CACHE_PREFETCH_MAX 64
+
+/* Block cache counters */
+struct cache_stats {
+	/* Lookups served from memory */
+	uint64_t hits;
+	/* Lookups that had to go to disk */
+	uint64_t misses;
+	/* Blocks dropped to make room for another block */
+	uint64_t evictions;
+	/* Dirty blocks written back to disk */
+	uint64_t writebacks;
+	/* Blocks loaded ahead of time by cache_prefetch() */
+	uint64_t prefetches;
+};
+
+/** Block cache of a virtual disk (opaque) */
+struct cache;
+
+/**
+ * cache_open - Set up a block cache
+ * @disk: Open virtual disk the cache sits in front of
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back LRU cache of @nblocks blocks sitting in front of
+ * @disk. Blocks have the block size of @disk, and %BLOCK_SIZE below stands for
+ * it. A cache of 0 blocks is valid and makes every access go straight to the
+ * disk. Caches of different disks are fully independent.
+ *
+ * Once open, the cache can be used by several threads at the same time. Disk
+ * reads are done without the cache lock held, so that misses of different
+ * threads are served in parallel. cache_open() and cache_close() must not run
+ * concurrently with any other call.
+ *
+ * Return: NULL if the cache cannot be allocated. Otherwise the new cache.
+ */
+struct cache *cache_open(struct disk *disk, size_t nblocks);
+
+/**
+ * cache_close - Tear down a block cache
+ * @cache: Open cache
+ *
+ * Write back every dirty block and release the cache memory. The disk is left
+ * open.
+ *
+ * Return: -1 if @cache is NULL or if a write back fails. 0 otherwise.
+ */
+int cache_close(struct cache *cache);
+
+/**
+ * cache_read - Read part of a block through the cache
+ * @cache: Open cache
+ * @block: Index of the disk block to read from
+ * @offset: Byte offset within the block
+ * @len: Number of bytes to read
+ * @buf: Data buffer to be filled
+ *
+ * Copy @len bytes starting at @offset of disk block @block into @buf, loading
+ * the block into the cache first if needed. @offset + @len cannot exceed
+ * %BLOCK_SIZE.
+ *
+ * Return: -1 if the block cannot be loaded. 0 otherwise.
+ */
+int cache_read(struct cache *cache, size_t block, size_t offset, size_t len,
+	       void *buf);
+
+/**
+ * cache_write - Write part of a block through the cache
+ * @cache: Open cache
+ * @block: Index of the disk block to write to
+ * @offset: Byte offset within the block
+ * @len: Number of bytes to write
+ * @buf: Data buffer to write in the block
+ *
+ * Copy @len bytes from @buf at @offset of disk block @block and mark the block
+ * dirty. The block is only loaded from disk when the write does not cover it
+ * entirely. @offset + @len cannot exceed %BLOCK_SIZE.
+ *
+ * Return: -1 if the block cannot be loaded or written. 0 otherwise.
+ */
+int cache_write(struct cache *cache, size_t block, size_t offset, size_t len,
+		const void *buf);
+
+/**
+ * cache_overwrite - Write part of a block whose other bytes do not matter
+ * @cache: Open cache
+ * @block: Index of the disk block to write to
+ * @offset: Byte offset within the block
+ * @len: Number of bytes to write
+ * @buf: Data buffer to write in the block
+ *
+ * Same as cache_write(), for a block that holds no useful data outside of the
+ * written range (for instance a block that was just allocated). The block is
+ * never loaded from disk: when it is not cached, the rest of it is zeroed.
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int cache_overwrite(struct cache *cache, size_t block, size_t offset,
+		    size_t len, const void *buf);
+
+/**
+ * cache_read_run - Read consecutive whole blocks through the cache
+ * @cache: Open cache
+ * @block: Index of the first disk block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled (@count * %BLOCK_SIZE bytes)
+ *
+ * Blocks present in the cache are copied from memory. Runs of blocks that are
+ * not cached are read from disk straight into @buf with a single vectored
+ * read, without being inserted in the cache, so that large sequential reads
+ * neither pay for an extra copy nor push hot blocks out of the cache.
+ *
+ * Return: -1 if reading from disk fails. 0 otherwise.
+ */
+int cache_read_run(struct cache *cache, size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_run - Write consecutive whole blocks through the cache
+ * @cache: Open cache
+ * @block: Index of the first disk block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks (@count * %BLOCK_SIZE bytes)
+ *
+ * Write the run to disk with a single vectored write. Cached copies of blocks
+ * of the run are updated and marked clean.
+ *
+ * Return: -1 if writing to disk fails. 0 otherwise.
+ */
+int cache_write_run(struct cache *cache, size_t block, size_t count,
+		    const void *buf);
+
+/**
+ * cache_writev - Write consecutive whole blocks from separate buffers
+ * @cache: Open cache
+ * @block: Index of the first disk block to write to
+ * @iov: One buffer of %BLOCK_SIZE bytes per block
+ * @iovcnt: Number of blocks to write
+ *
+ * Same as cache_write_run(), for blocks whose content is not contiguous in
+ * memory.
+ *
+ * Return: -1 if writing to disk fails. 0 otherwise.
+ */
+int cache_writev(struct cache *cache, size_t block, const struct iovec *iov,
+		 int iovcnt);
+
+/**
+ * cache_invalidate - Drop a block from the cache
+ * @cache: Open cache
+ * @block: Index of the disk block
+ *
+ * Forget the cached copy of @block, if any, without writing it back. Used when
+ * the block is freed and its content no longer matters.
+ */
+void cache_invalidate(struct cache *cache, size_t block);
+
+/**
+ * cache_contains - Check whether a block is cached
+ * @cache: Open cache
+ * @block: Index of the disk block
+ *
+ * Return: 1 if the cache holds a copy of @block, which may be more recent than
+ * the block on disk. 0 otherwise.
+ */
+int cache_contains(struct cache *cache, size_t block);
+
+/**
+ * cache_prefetch - Load consecutive blocks into the cache
+ * @cache: Open cache
+ * @block: Index of the first disk block to load
+ * @count: Number of blocks to load
+ *
+ * Load the blocks of the run that are not cached yet, with a single vectored
+ * read per sub-run, so that later accesses to them are hits. Used to read
+ * ahead of a sequential reader. At most %CACHE_PREFETCH_MAX blocks, and half of
+ * the entries that are not pinned, are loaded.
+ *
+ * Return: -1 if reading from disk fails. 0 otherwise.
+ */
+int cache_prefetch(struct cache *cache, size_t block, size_t count);
+
+/**
+ * cache_pin - Get a pointer to the cached content of a block
+ * @cache: Open cache
+ * @block: Index of the disk block
+ * @load: Load the block from disk if it is not cached
+ *
+ * Pin the cache entry holding @block, so that it cannot be evicted, and return
+ * its data. The pointer stays valid until the matching cache_unpin(), and must
+ * be treated as read-only.
+ *
+ * One entry is never pinned, so that cache_read() and cache_write() keep
+ * working while pointers are held.
+ *
+ * Return: NULL if the block is not cached and @load is not set, if it cannot
+ * be loaded, or if no more entries can be pinned. Otherwise the %BLOCK_SIZE
+ * bytes of the block.
+ */
+const void *cache_pin(struct cache *cache, size_t block, int load);
+
+/**
+ * cache_unpin - Release a pointer obtained from cache_pin()
+ * @cache: Open cache
+ * @data: Pointer returned by cache_pin()
+ */
+void cache_unpin(struct cache *cache, const void *data);
+
+/**
+ * cache_flush - Write back dirty blocks
+ * @cache: Open cache
+ *
+ * Return: -1 if a write back fails. 0 otherwise.
+ */
+int cache_flush(struct cache *cache);
+
+/**
+ * cache_get_stats - Get cache counters
+ * @cache: Open cache
+ * @stats: Structure to be filled with the counters
+ */
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
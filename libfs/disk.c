@@ -1,144 +1,452 @@
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "iosched.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Maximum number of buffers in a single vectored transfer */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
-	/* Block count */
+	/* Block size and count */
+	size_t block_size;
 	size_t bcount;
+	/* Mapping of the whole image (BLOCK_BACKEND_MMAP only) */
+	uint8_t *map;
+	/* Request scheduler, NULL when transfers are dispatched right away */
+	struct iosched *sched;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Virtual disk used by the block_*() functions (none by default) */
+static struct disk *cur_disk;
 
-int block_disk_open(const char *diskname)
+struct disk *disk_open(const char *diskname, enum block_backend backend,
+		       size_t block_size)
 {
+	struct disk *disk;
 	int fd;
 	struct stat st;
+	void *map = NULL;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
+		return NULL;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+	if (!block_size) {
+		block_error("invalid block size");
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (st.st_size % block_size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    st.st_size, block_size);
+		close(fd);
+		return NULL;
+	}
+
+	if (backend == BLOCK_BACKEND_MMAP && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return NULL;
+		}
+	}
+
+	disk = malloc(sizeof(*disk));
+	if (!disk) {
+		if (map)
+			munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	disk->fd = fd;
+	disk->block_size = block_size;
+	disk->bcount = st.st_size / block_size;
+	disk->map = map;
+	disk->sched = NULL;
+
+	return disk;
+}
+
+struct disk *disk_create(const char *diskname, size_t bcount,
+			 enum block_backend backend, size_t block_size)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	/* Blocks never written read as zeros, without taking up space */
+	if (ftruncate(fd, (off_t)bcount * block_size)) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	return disk_open(diskname, backend, block_size);
+}
+
+int disk_close(struct disk *disk)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	iosched_close(disk->sched);
+	if (disk->map)
+		munmap(disk->map, disk->bcount * disk->block_size);
+	close(disk->fd);
+	free(disk);
 
 	return 0;
 }
 
-int block_disk_close(void)
+int disk_sync(struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	/* Writes to the file descriptor are already in the kernel's hands */
+	if (!disk->map)
+		return 0;
 
-	disk.fd = INVALID_FD;
+	if (msync(disk->map, disk->bcount * disk->block_size, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
 
 	return 0;
 }
 
-int block_disk_count(void)
+int disk_count(const struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
-int block_write(size_t block, const void *buf)
+size_t disk_block_size(const struct disk *disk)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
+	return disk ? disk->block_size : 0;
+}
+
+const void *disk_map(const struct disk *disk, size_t block)
+{
+	if (!disk || !disk->map || block >= disk->bcount)
+		return NULL;
+
+	return disk->map + block * disk->block_size;
+}
+
+/*
+ * Transfer @iovcnt buffers to or from the disk image at byte position @pos.
+ * Short transfers are resumed and vectors longer than IOV_MAX are split, so
+ * on success every byte described by @iov has been moved.
+ */
+static int disk_xfer(struct disk *disk, int write, off_t pos,
+		     const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[IOV_MAX];
+	int cnt = 0;
+
+	/* Memory-mapped image, no system call involved */
+	if (disk->map) {
+		for (int i = 0; i < iovcnt; i++) {
+			if (write)
+				memcpy(disk->map + pos, iov[i].iov_base,
+				       iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, disk->map + pos,
+				       iov[i].iov_len);
+			pos += iov[i].iov_len;
+		}
+		return 0;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
-		return -1;
+	while (iovcnt > 0 || cnt > 0) {
+		ssize_t ret;
+		int done = 0;
+
+		/* Refill local vector, which may be partially consumed */
+		while (cnt < IOV_MAX && iovcnt > 0) {
+			vec[cnt++] = *iov++;
+			iovcnt--;
+		}
+
+		if (write)
+			ret = pwritev(disk->fd, vec, cnt, pos);
+		else
+			ret = preadv(disk->fd, vec, cnt, pos);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+		pos += ret;
+
+		/* Drop the buffers that were completely transferred */
+		while (done < cnt && (size_t)ret >= vec[done].iov_len)
+			ret -= vec[done++].iov_len;
+		if (done < cnt) {
+			vec[done].iov_base = (char *)vec[done].iov_base + ret;
+			vec[done].iov_len -= ret;
+		}
+		memmove(vec, vec + done, (cnt - done) * sizeof(*vec));
+		cnt -= done;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+/* Transfer function of the request scheduler, @ctx being the disk */
+static int disk_sched_xfer(void *ctx, int write, size_t block,
+			   const struct iovec *iov, int iovcnt)
+{
+	struct disk *disk = ctx;
+
+	return disk_xfer(disk, write, (off_t)block * disk->block_size, iov,
+			 iovcnt);
+}
+
+/*
+ * Transfer @count blocks starting at @block, through the request scheduler if
+ * the disk has one.
+ */
+static int disk_submit(struct disk *disk, int write, size_t block,
+		       size_t count, const struct iovec *iov, int iovcnt)
+{
+	if (disk->sched)
+		return iosched_submit(disk->sched, write, block, count, iov,
+				    iovcnt);
+
+	return disk_xfer(disk, write, (off_t)block * disk->block_size, iov,
+			 iovcnt);
+}
+
+/* Check that the run of @count blocks starting at @block can be accessed */
+static int disk_check(const struct disk *disk, size_t block, size_t count)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= disk->bcount || count > disk->bcount - block) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count - 1, disk->bcount);
 		return -1;
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Number of blocks of @disk described by @iov, which must be whole blocks */
+static ssize_t block_iov_count(const struct disk *disk,
+			       const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t len = 0;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len % disk->block_size != 0) {
+		block_error("length '%zu' is not multiple of '%zu'",
+			    len, disk->block_size);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return len / disk->block_size;
+}
+
+int disk_write(struct disk *disk, size_t block, const void *buf)
+{
+	struct iovec iov = { .iov_base = (void *)buf };
+
+	if (disk_check(disk, block, 1))
 		return -1;
-	}
+	iov.iov_len = disk->block_size;
+
+	/* Perform the actual write into the disk image, at the block's
+	 * position so that the shared file offset is never used */
+	return disk_submit(disk, 1, block, 1, &iov, 1);
+}
+
+int disk_read(struct disk *disk, size_t block, void *buf)
+{
+	struct iovec iov = { .iov_base = buf };
+
+	if (disk_check(disk, block, 1))
+		return -1;
+	iov.iov_len = disk->block_size;
 
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return disk_submit(disk, 0, block, 1, &iov, 1);
+}
+
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt)
+{
+	ssize_t count = block_iov_count(disk, iov, iovcnt);
+
+	if (count < 0 || disk_check(disk, block, count))
+		return -1;
+
+	return disk_submit(disk, 1, block, count, iov, iovcnt);
+}
+
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt)
+{
+	ssize_t count = block_iov_count(disk, iov, iovcnt);
+
+	if (count < 0 || disk_check(disk, block, count))
+		return -1;
+
+	return disk_submit(disk, 0, block, count, iov, iovcnt);
+}
+
+int disk_set_window(struct disk *disk, unsigned int window_us)
+{
+	struct iosched *sched = NULL;
+
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
+	if (window_us) {
+		sched = iosched_open(disk_sched_xfer, disk, window_us);
+		if (!sched)
+			return -1;
+	}
+
+	iosched_close(disk->sched);
+	disk->sched = sched;
+
 	return 0;
 }
 
+void disk_get_sched_stats(struct disk *disk, struct iosched_stats *stats)
+{
+	if (!disk || !disk->sched) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	iosched_get_stats(disk->sched, stats);
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FD);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+	if (cur_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	cur_disk = disk_open(diskname, backend, BLOCK_SIZE);
+
+	return cur_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	int ret = disk_close(cur_disk);
+
+	cur_disk = NULL;
+	return ret;
+}
+
+int block_disk_sync(void)
+{
+	return disk_sync(cur_disk);
+}
+
+int block_disk_count(void)
+{
+	return disk_count(cur_disk);
+}
+
+const void *block_map(size_t block)
+{
+	return disk_map(cur_disk, block);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return disk_write(cur_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_read(cur_disk, block, buf);
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_writev(cur_disk, block, iov, iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return disk_readv(cur_disk, block, iov, iovcnt);
+}
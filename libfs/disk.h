@@ -2,10 +2,19 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, for the block_*() functions */
 #define BLOCK_SIZE 4096
 
+/** Ways of accessing the virtual disk file */
+enum block_backend {
+	/** System calls on a file descriptor */
+	BLOCK_BACKEND_FD,
+	/** Memory mapping of the whole file */
+	BLOCK_BACKEND_MMAP,
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +23,31 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * Block transfers are positional and never use a shared file offset, so
+ * block_read(), block_write() and their vectored versions can be called from
+ * several threads at the same time while the disk is open.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: How blocks are accessed
+ *
+ * Same as block_disk_open(), which uses %BLOCK_BACKEND_FD. With
+ * %BLOCK_BACKEND_MMAP, the whole file is mapped in memory: block_read() and
+ * block_write() become copies from and to the mapping, and written blocks
+ * reach the file through the page cache without a system call each. Use
+ * block_disk_sync() to force them to the file.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +55,18 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush written blocks to virtual disk file
+ *
+ * With %BLOCK_BACKEND_MMAP, synchronously write the modified pages of the
+ * mapping back to the file. Writes of %BLOCK_BACKEND_FD are already handed to
+ * the file when they return, so there is nothing to do.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +101,200 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Gather the content of the buffers described by @iov and write it in the
+ * virtual disk's blocks starting at @block, using as few system calls as
+ * possible. The total length of the buffers must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible, or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the virtual disk's blocks starting at @block and scatter their content
+ * into the buffers described by @iov, using as few system calls as possible.
+ * The total length of the buffers must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if one of
+ * the blocks is out of bounds or inaccessible, or if the reading operation
+ * fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_map - Get the address of a block in memory
+ * @block: Index of the block
+ *
+ * With %BLOCK_BACKEND_MMAP, return where block @block lives in the mapping of
+ * the virtual disk file, so that it can be read without any copy. The pointer
+ * is valid until block_disk_close().
+ *
+ * Return: NULL if the virtual disk file is not memory-mapped, or if @block is
+ * out of bounds. Otherwise the address of the block.
+ */
+const void *block_map(size_t block);
+
+/*
+ * Handle-based interface
+ *
+ * The block_*() functions above work on a single virtual disk per process. The
+ * functions below do the same on a disk handle, so that several virtual disk
+ * files can be open at the same time, each with its own block size. The
+ * block_*() functions are implemented on top of them, with %BLOCK_SIZE blocks.
+ * Where the descriptions of the block_*() functions mention %BLOCK_SIZE, the
+ * block size of the disk applies.
+ */
+
+/** Open virtual disk file (opaque) */
+struct disk;
+
+/**
+ * disk_open - Open virtual disk file and get a handle to it
+ * @diskname: Name of the virtual disk file
+ * @backend: How blocks are accessed
+ * @block_size: Size of a block in bytes
+ *
+ * Same as block_disk_open_backend(), but any number of virtual disk files can
+ * be open at the same time, and blocks are @block_size bytes long.
+ *
+ * Return: NULL if @diskname is invalid, if @block_size is 0, or if the virtual
+ * disk file cannot be opened or mapped, or if its size is not a multiple of
+ * @block_size. Otherwise the handle of the open disk.
+ */
+struct disk *disk_open(const char *diskname, enum block_backend backend,
+		       size_t block_size);
+
+/**
+ * disk_create - Create virtual disk file and get a handle to it
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the new disk
+ * @backend: How blocks are accessed
+ * @block_size: Size of a block in bytes
+ *
+ * Create virtual disk file @diskname, replacing any file of that name, with
+ * @bcount blocks filled with zeros, and open it like disk_open().
+ *
+ * Return: NULL if @diskname is invalid, if @block_size is 0, or if the virtual
+ * disk file cannot be created or opened. Otherwise the handle of the open
+ * disk.
+ */
+struct disk *disk_create(const char *diskname, size_t bcount,
+			 enum block_backend backend, size_t block_size);
+
+/**
+ * disk_close - Close virtual disk file and release its handle
+ * @disk: Open disk
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int disk_close(struct disk *disk);
+
+/**
+ * disk_sync - Same as block_disk_sync(), on @disk
+ * @disk: Open disk
+ */
+int disk_sync(struct disk *disk);
+
+/**
+ * disk_count - Same as block_disk_count(), on @disk
+ * @disk: Open disk
+ */
+int disk_count(const struct disk *disk);
+
+/**
+ * disk_block_size - Get the block size of a disk
+ * @disk: Open disk
+ *
+ * Return: 0 if @disk is NULL. Otherwise the size of its blocks in bytes.
+ */
+size_t disk_block_size(const struct disk *disk);
+
+/**
+ * disk_write - Same as block_write(), on @disk
+ * @disk: Open disk
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ */
+int disk_write(struct disk *disk, size_t block, const void *buf);
+
+/**
+ * disk_read - Same as block_read(), on @disk
+ * @disk: Open disk
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ */
+int disk_read(struct disk *disk, size_t block, void *buf);
+
+/**
+ * disk_writev - Same as block_writev(), on @disk
+ * @disk: Open disk
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ */
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+		int iovcnt);
+
+/**
+ * disk_readv - Same as block_readv(), on @disk
+ * @disk: Open disk
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ */
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+	       int iovcnt);
+
+/**
+ * disk_map - Same as block_map(), on @disk
+ * @disk: Open disk
+ * @block: Index of the block
+ *
+ * The pointer is valid until disk_close().
+ */
+const void *disk_map(const struct disk *disk, size_t block);
+
+/** Block request scheduler counters, see iosched.h */
+struct iosched_stats;
+
+/**
+ * disk_set_window - Set the batching window of a disk
+ * @disk: Open disk
+ * @window_us: Batching window, in microseconds, 0 to disable batching
+ *
+ * With a non-zero window, block transfers on @disk are no longer performed
+ * right away: they are held for up to @window_us, sorted by block number, and
+ * adjacent ones are merged into single multi-block transfers (see
+ * iosched_open()). Each transfer still returns once its blocks were moved.
+ * Batching pays off when several threads keep transfers in flight on a slow
+ * backing storage, and only adds latency otherwise.
+ *
+ * Must not be called while transfers are in progress on @disk.
+ *
+ * Return: -1 if @disk is NULL or if the scheduler cannot be allocated. 0
+ * otherwise.
+ */
+int disk_set_window(struct disk *disk, unsigned int window_us);
+
+/**
+ * disk_get_sched_stats - Get the request scheduler counters of a disk
+ * @disk: Open disk
+ * @stats: Structure to be filled with the counters, zeroed if @disk has no
+ * batching window
+ */
+void disk_get_sched_stats(struct disk *disk, struct iosched_stats *stats);
+
 #endif /* _DISK_H */
 
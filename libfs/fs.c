@@ -1,30 +1,124 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "aio.h"
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "iosched.h"
 
 #define SIG_LEN 8
+#define SIG_V1 "ECS150FS" // signature of version 1 (ECS150FS) file systems
+#define SIG_V2 "ECS150F2" // signature of version 2 file systems
 #define SUPER_BLOCK_PADDING 4079
+#define SUPER_BLOCK_V2_PADDING 4060
+#define SUPER_BLOCK_SIZE 4096 // both formats, only the start of it fits in small blocks
 #define ROOT_PADDING 10
-#define BLOCK_SIZE 4096
-#define FAT_EOC 0xFFFF
+#define ROOT_SIZE 4096 // root directory, whatever the block size
+#define ROOT_ENTRY_SIZE 32 // both formats
+#define DEFAULT_BLOCK_SIZE 4096 // block size of version 1, and of version 2 when not recorded
+#define FAT_EOC 0xFFFFFFFFu // end of a chain in memory, whatever the format
+#define FAT_EOC_V1 0xFFFF // end of a chain in a version 1 FAT
+#define MAX_BLKS_V1 0xFFFF // largest volume of each format, in blocks
+#define MAX_BLKS_V2 0x7FFFFFFF
 #define MAX_FD 32  //maximum of 32 file descriptors that can be open simultaneously.
+#define NAME_HASH_BUCKETS 256 // power of two, kept at least twice the number of files
+#define DIR_ROOT 0 // parent of the entries of the root directory
+#define DIR_FLAG 0x80000000u // set in the parent field of directories on disk
+#define SKIP_INTERVAL 64 // logical blocks between two entries of a skip index
+#define RESERVE_WINDOW 64 // free blocks after an open file's last block kept for it
+#define FLUSH_RUN_MAX 64 // buffered blocks written by a single request when flushed
+#define READAHEAD_MIN 4 // first readahead window of a sequential reader, in blocks
+
+/* where the data of a struct fs_span comes from */
+#define SPAN_CACHE 1 // pinned block cache entry
+#define SPAN_MAP 2 // memory mapping of the virtual disk
+#define SPAN_COPY 3 // buffer allocated for the span
 
 #define MIN(a,b) (((a)<(b))?(a):(b)) // find minuim of two
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
 
 /* Function declarations */
-int file_locator(const char* );
-int current_block_loactor(uint64_t offset,  int first_blk_index);
-int free_db_entries_locator();
-
+int file_locator(struct fs* fs, const char* );
+int path_locator(struct fs* fs, const char* path, uint32_t* parent, const char** name, size_t* len);
+int entry_locator(struct fs* fs, uint32_t parent, const char* name, size_t len);
+uint32_t entry_hash(uint32_t parent, const char* name, size_t len);
+char* entry_path(struct fs* fs, uint32_t file_index);
+int name_index_builder(struct fs* fs, uint32_t n_buckets);
+void name_index_insert(struct fs* fs, int file_index);
+void name_index_remove(struct fs* fs, int file_index);
+struct chain_cursor;
+uint32_t cursor_locator(struct fs* fs, int fd, struct chain_cursor* cursor, uint32_t blk_num);
+struct open_file_t* open_file_locator(struct fs* fs, int file_index);
+void open_file_release(struct open_file_t* file);
+void skip_index_note(struct open_file_t* file, uint32_t blk_num, uint32_t blk);
+uint32_t tail_locator(struct fs* fs, struct open_file_t* file);
+int delalloc_write(struct fs* fs, struct open_file_t* file, uint32_t blk_num, size_t offset_from_blk, size_t len, const void* buf);
+void delalloc_read(struct open_file_t* file, uint32_t blk_num, size_t offset_from_blk, size_t len, void* buf);
+int delalloc_flush(struct fs* fs, struct open_file_t* file);
+int delalloc_flush_all(struct fs* fs);
+uint32_t fat_get(struct fs* fs, uint32_t idx);
+void fat_set(struct fs* fs, uint32_t idx, uint32_t value);
+uint32_t* fat_page_locator(struct fs* fs, uint32_t fat_blk);
+int fat_pager_builder(struct fs* fs);
+void fat_pager_release(struct fs* fs);
+size_t fat_entry_size(struct fs* fs);
+size_t fat_entries_per_blk(struct fs* fs);
+void fat_widen(struct fs* fs, uint32_t* entries, size_t n_entries);
+const void* fat_block_encode(struct fs* fs, const uint32_t* entries, uint8_t* buf);
+int superblock_decode(struct fs* fs, const void* blk);
+struct superblock_t;
+void superblock_encode(const struct superblock_t* sb, void* blk);
+uint32_t root_blk_count(const struct superblock_t* sb);
+void root_decode(struct fs* fs, uint32_t first, uint32_t n_entries, const uint8_t* blk);
+void root_encode(struct fs* fs, uint32_t first, uint32_t n_entries, uint8_t* blk);
+void root_entry_dirty(struct fs* fs, int file_index);
+uint32_t dir_blk_locator(struct fs* fs, uint32_t file_index, uint32_t* first, uint32_t* n_entries);
+int dir_loader(struct fs* fs);
+int dir_grow(struct fs* fs);
+int dir_blk_append(struct fs* fs, uint32_t blk);
+int dir_capacity_reserve(struct fs* fs, uint32_t n_entries);
+void dir_release(struct fs* fs);
+int metadata_writeback(struct fs* fs);
+int free_db_entries_locator(struct fs* fs, uint32_t start_blk);
+int next_free_blk_locator(struct fs* fs, size_t start_blk);
+size_t free_run_length(struct fs* fs, uint32_t blk, size_t max_blks);
+int free_run_locator(struct fs* fs, uint32_t start_blk, size_t n_blks, struct open_file_t* self);
+size_t reservation_conflict(struct fs* fs, struct open_file_t* self, size_t blk, size_t n_blks);
+uint32_t reserve_locator(struct fs* fs, struct open_file_t* file, uint32_t last_blk, size_t n_blks);
+int free_map_builder(struct fs* fs);
+void free_map_update(struct fs* fs, uint32_t blk, int is_free);
+void free_map_scan(struct fs* fs, uint32_t blk);
+uint32_t free_blk_counter(struct fs* fs, uint32_t n_wanted);
+int block_allocator(struct fs* fs, struct open_file_t* file, uint32_t prev_blk, uint32_t goal_blk);
+int fd_acquire(struct fs* fs, int fd);
+size_t contiguous_run_locator(struct fs* fs, uint32_t first_blk, size_t max_blks);
+void readahead(struct fs* fs, int fd, uint32_t first_blk, uint64_t end, const struct chain_cursor* cursor);
+ssize_t iov_length(const struct iovec* iov, int iovcnt);
+struct iov_cursor;
+size_t iov_contig(struct iov_cursor* cur);
+uint8_t* iov_base(struct iov_cursor* cur);
+const void* iov_gather(struct iov_cursor* cur, size_t len, uint8_t* bounce_buf);
+void iov_scatter(struct iov_cursor* cur, size_t len, const uint8_t* data);
+
+
+/* position within the user buffers of a vectored read or write */
+struct iov_cursor {
+	const struct iovec* iov;
+	int iovcnt;
+	size_t pos; // bytes of iov[0] already transfered
+};
 
 /*  n_ stands for "number of"  */
-struct superblock_t {
+struct superblock_v1_t {
     char     signature[SIG_LEN];  // must equal "ECS150FS"
     uint16_t n_blks;   // number of all blocks (super + fat + root + data)
     uint16_t root_dir_index;
@@ -34,263 +128,754 @@ struct superblock_t {
     uint8_t not_used[SUPER_BLOCK_PADDING]; // ignore
 } __attribute__((packed));
 
+/* version 2 has the same fields, 32 bits wide, and FAT entries of 32 bits */
+struct superblock_v2_t {
+    char     signature[SIG_LEN];  // must equal "ECS150F2"
+    uint32_t n_blks;
+    uint32_t root_dir_index;
+    uint32_t data_blk_start_index;
+    uint32_t n_data_blks;
+    uint32_t n_FAT_blks;
+    uint32_t block_size; // in bytes, 0 stands for DEFAULT_BLOCK_SIZE
+    uint32_t root_ext_blk; // first datablock of the root directory extension, 0 if none
+    uint8_t not_used[SUPER_BLOCK_V2_PADDING];
+} __attribute__((packed));
 
+/* superblock of the mounted FS, whatever its on-disk format */
+struct superblock_t {
+	int      version; // FS_VERSION_1 or FS_VERSION_2
+	uint32_t n_blks;
+	uint32_t root_dir_index;
+	uint32_t data_blk_start_index;
+	uint32_t n_data_blks;
+	uint32_t n_FAT_blks;
+	uint32_t block_size;
+	uint32_t root_ext_blk; // always 0 for version 1
+};
 
-struct root_t{
+struct root_v1_t{
 	char     filename[FS_FILENAME_LEN];  // including NULL
 	uint32_t file_size;
 	uint16_t idx_first_blk;
 	uint8_t  not_used[ROOT_PADDING];
 } __attribute__((packed));
 
+/* version 2 root entries are 32 bytes as well */
+struct root_v2_t{
+	char     filename[FS_FILENAME_LEN];
+	uint64_t file_size;
+	uint32_t idx_first_blk;
+	uint32_t parent; // like root_t.parent, with DIR_FLAG set for directories
+} __attribute__((packed));
+
+/* root entry of the mounted FS, whatever its on-disk format. Every file
+   and directory has one: the root entries of a version 2 FS hold the whole
+   tree, each entry naming the directory it belongs to */
+struct root_t{
+	char     filename[FS_FILENAME_LEN];
+	uint64_t file_size;
+	uint32_t idx_first_blk;
+	uint32_t parent; // DIR_ROOT, or 1 + the root entry of its directory
+	uint8_t  is_dir;
+	uint32_t n_children; // entries in a directory, counted at mount time
+};
+
+
+/* state shared by every FD opened on the same file */
+struct open_file_t {
+	int32_t  file_index; // position of the file in the root directory, -1 if unused
+	uint8_t  n_open;     // number of FDs referring to this file
+	/* skip index, filled lazily while the FAT chain is walked: skip[k] is 
+	   the datablock holding logical block k*SKIP_INTERVAL of the file */
+	uint32_t* skip;
+	uint32_t n_skip;
+	uint32_t skip_capacity;
+	/* last datablock of the file when known (FAT_EOC otherwise). The
+	   RESERVE_WINDOW blocks after it are avoided when other files look 
+	   for room, so files written at the same time don't get interleaved */
+	uint32_t tail_blk;
+	/* protects the skip index, which readers of the file update */
+	pthread_mutex_t lock;
+	/* delayed allocation: number of blocks in the FAT chain of the file, 
+	   and content of the blocks written past them, which don't have a 
+	   datablock yet */
+	uint32_t n_alloc_blks;
+	uint8_t** pending;
+	uint32_t n_pending;
+	uint32_t pending_capacity;
+};
+
+/* block of a file reached last: logical block number within the file and
+   datablock index (FAT_EOC if none yet) */
+struct chain_cursor {
+	uint32_t blk;
+	uint32_t phys;
+};
 
 struct file_descriptor_t {           
+	/* protects the fields below while readers share the FS. fs_pread
+	   only tries it, see fsi_preadv */
+	pthread_mutex_t lock;
 	uint64_t offset;  
-	char   file_name[FS_FILENAME_LEN];
+	int32_t  file_index; // position of the file in the root directory
+	struct open_file_t* file;
 	uint8_t   is_free;
+	/* last block of the file reached through this FD. fs_pread works on
+	   a copy of it, so that threads sharing the FD don't wait for each
+	   other */
+	struct chain_cursor cursor;
+	/* sequential readahead: logical block where the next read starts if
+	   the FD is read sequentially, number of blocks read ahead last time 
+	   (0 while the accesses look random), and first block not read ahead */
+	uint32_t ra_next_blk;
+	uint32_t ra_window;
+	uint32_t ra_end_blk;
 };
 
-struct superblock_t  superblock;
-struct root_t root[FS_FILE_MAX_COUNT]; // 128 entries. each entry is 32byte 
-uint16_t* FAT; // used to traverse FAT entries
-struct file_descriptor_t fd_table[MAX_FD]; // we can have up to 32 FS
+/* FAT block loaded in memory by the FAT pager */
+/* update of a paged FAT entry whose FAT block couldn't be loaded */
+struct fat_update_t {
+	uint32_t idx;
+	uint32_t value;
+};
+
+struct fat_page_t {
+	uint32_t  fat_blk;   // FAT block held, FAT_EOC if the page is unused
+	uint64_t  last_use;  // value of fat_clock when it was last accessed
+	uint32_t* entries;   // its entries, 32 bits wide whatever the format
+};
+
+/* mounted disk: everything the calls made through its handle work on */
+struct fs {
+	/* FS lock: calls that only read metadata (fs_read, fs_stat, ...) hold
+	   it shared and run in parallel, other calls hold it exclusively */
+	pthread_rwlock_t lock;
+
+	struct disk* disk; // virtual disk the FS lives on
+	struct cache* cache; // block cache of the disk, not shared with other FS
+	struct superblock_t  superblock;
+	/* root entries: the FS_FILE_MAX_COUNT of the root directory blocks,
+	   then for version 2 those of the datablocks chained from
+	   superblock.root_ext_blk, added as the directory fills up. Memory is
+	   allocated for root_capacity entries, which grows by doubling */
+	struct root_t* root;
+	uint32_t n_root_entries;
+	uint32_t root_capacity;
+	uint32_t n_files; // root entries in use
+	uint32_t root_free_hint; // every root entry before this one is in use
+	uint32_t* dir_blks; // datablocks of the extension, in chain order
+	uint32_t n_dir_blks;
+	uint8_t* meta_buf; // root directory or FAT block as stored on disk, used with the FS locked exclusively or fat_lock held
+	uint32_t* FAT; // used to traverse FAT entries, NULL when the FAT is paged
+	struct file_descriptor_t fd_table[MAX_FD]; // we can have up to 32 FS
+	struct open_file_t open_files[MAX_FD]; // at most one per FD
+	size_t cache_size; // number of data blocks kept in memory
+	size_t delalloc_max_blks; // buffered blocks allowed before flushing, 0 disables delayed allocation
+	size_t n_delalloc_blks; // blocks buffered by delayed allocation, all files together
+	uint64_t mount_time_ns; // how long fs_mount took
+	int sync_mode; // when set, fs_create and fs_delete write metadata to disk right away
+	size_t readahead_max_blks; // largest readahead window, 0 disables readahead
+	unsigned int sched_window_us; // batching window of disk requests, 0 dispatches them right away
+
+	/* I/O threads running asynchronous requests, started by the first
+	   one. aio_lock protects the pointer, the pool has its own lock */
+	pthread_mutex_t aio_lock;
+	struct aio_pool* aio;
+	size_t aio_threads;
+
+	/* metadata changed since it was last written: one flag per FAT block,
+	   one bit per root entry and the superblock. Only these parts are
+	   written by fs_sync */
+	uint8_t* fat_dirty;
+	uint64_t* root_dirty;
+	int sb_dirty;
+
+	/* paged FAT, when fat_max_blks isn't 0: instead of reading the whole
+	   FAT at mount time, FAT blocks are loaded when one of their entries is
+	   needed, in at most fat_max_blks pages. The least recently used page
+	   is reused when they are all taken, once written back if it is dirty.
+	   fat_page_index[i] is 1 + the page holding FAT block i, 0 if it isn't
+	   loaded. fat_lock protects the pages, which readers load while 
+	   sharing the FS */
+	size_t fat_max_blks;
+	struct fat_page_t* fat_pages;
+	uint32_t* fat_page_index;
+	uint64_t fat_clock;
+	uint64_t fat_loads;
+	uint64_t fat_evictions;
+	/* updates of FAT blocks that couldn't be loaded, made once their
+	   block is loaded again. fat_error is set if one of them was lost for
+	   lack of memory */
+	struct fat_update_t* fat_pending;
+	size_t n_fat_pending;
+	size_t fat_pending_capacity;
+	int fat_error;
+	pthread_mutex_t fat_lock;
+	/* with a paged FAT, the free-space bitmap is filled one FAT block at a
+	   time, when allocations get there: fat_scanned[i] is set once the
+	   free entries of FAT block i are in the bitmap */
+	uint8_t* fat_scanned;
+	uint32_t n_unscanned_fat_blks;
+
+	/* free-space bitmap, built at mount time from FAT: bit i is set when
+	   datablock i is free */
+	uint64_t* free_map;
+	size_t free_map_words;
+	uint32_t n_free_blks;
+
+	/* directory entry index, built at mount time from root and keyed by
+	   (parent, filename), so resolving a path costs a lookup per component
+	   and never reads the disk: name_buckets[h] is the first root entry
+	   whose key hashes to h, and name_chain[i] is the next root entry in
+	   the same bucket as entry i (-1 ends a chain). The number of buckets
+	   is doubled as files are created */
+	int32_t* name_buckets;
+	uint32_t n_name_buckets;
+	int32_t* name_chain;
+};
+
+/* FS used by the calls without a handle (fs_mount, fs_read, ...), NULL when
+   none is mounted, and the settings it gets mounted with. default_lock is
+   held shared around every such call, and exclusively to change them */
+struct fs* default_fs;
+struct fs_options default_options = {
+	.cache_blocks = CACHE_DEFAULT_BLOCKS,
+	.readahead_blocks = CACHE_PREFETCH_MAX,
+	.aio_threads = AIO_DEFAULT_THREADS,
+};
+pthread_rwlock_t default_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 // ======= PHASE 1   ====================================================================================
 
-int fs_mount(const char *diskname)
+static int fs_mount_disk(struct fs *fs, const char *diskname, enum block_backend backend)
 {
-	if (block_disk_open(diskname) == -1) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// the block size is recorded in the superblock: read the start of
+	// block 0 with the smallest block size any volume has, then reopen the
+	// disk with the right one
+	fs->disk = disk_open(diskname, backend, FS_BLOCK_SIZE_MIN);
+	if (!fs->disk) {
 		return -1;
 	}
 
-	if (block_read(0, &superblock) == -1) /* read onto superblock*/
+	uint8_t blk[SUPER_BLOCK_SIZE] = { 0 }; // superblock as stored on disk
+	if (disk_read(fs->disk, 0, blk) == -1) /* read onto superblock*/
 	{
+		disk_close(fs->disk);
 		return -1;
 	}
 
-	if (strncmp((superblock.signature), "ECS150FS", SIG_LEN) != 0) {
-		// signature doesn't match
+	if (superblock_decode(fs, blk) == -1) {
+		// signature doesn't match, or the layout makes no sense
+		disk_close(fs->disk);
 		return -1;
 	}
 
-	if (superblock.n_blks != block_disk_count()) {
+	if (fs->superblock.block_size != FS_BLOCK_SIZE_MIN) {
+		disk_close(fs->disk);
+		fs->disk = disk_open(diskname, backend, fs->superblock.block_size);
+		if (!fs->disk) {
+			return -1;
+		}
+	}
+
+	if (fs->superblock.n_blks != (uint32_t)disk_count(fs->disk)) {
+		disk_close(fs->disk);
 		return -1;
 	}
 
-	FAT  = malloc(superblock.n_FAT_blks * BLOCK_SIZE);
-	if (!FAT)
+	size_t block_size = fs->superblock.block_size;
+	fs->meta_buf = malloc(MAX(block_size, ROOT_SIZE));
+	if (!fs->meta_buf)
+	{
+		disk_close(fs->disk);
 		return -1;
+	}
 
-	// read all FAT entries as a chunks of blocks
-	for (int i = 0; i < superblock.n_FAT_blks; i++)
-	{   // read from i+1, since the first blk is superblock
-		if ( block_read(i+1, (void*) FAT+(i*BLOCK_SIZE)) == -1)
-		{
-			free(FAT);
-			return -1;
-		}
+	// FAT entries are 32 bits wide in memory, whatever the format. A paged
+	// FAT is left on disk until its entries are needed
+	size_t fat_len = (size_t)fs->superblock.n_FAT_blks * block_size;
+	if (!fs->fat_max_blks)
+		fs->FAT  = malloc(fat_len / fat_entry_size(fs) * sizeof(uint32_t));
+	if (fs->fat_max_blks ? fat_pager_builder(fs) == -1 : !fs->FAT)
+	{
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+
+	// read all FAT entries and the root entries, which follow them on disk,
+	// with a single request
+	size_t root_len = (size_t)root_blk_count(&fs->superblock) * block_size;
+	struct iovec iov[2] = {
+		{ .iov_base = fs->FAT, .iov_len = fat_len },
+		{ .iov_base = fs->meta_buf, .iov_len = root_len },
+	};
+	int n_iov = (fs->FAT && fs->superblock.root_dir_index == fs->superblock.n_FAT_blks + 1) ? 2 : 1;
+	// read from 1, since the first blk is superblock
+	if ((fs->FAT && disk_readv(fs->disk, 1, iov, n_iov) == -1)
+	    || (n_iov == 1 && disk_readv(fs->disk, fs->superblock.root_dir_index, &iov[1], 1) == -1))
+	{
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+	if (fs->FAT)
+		fat_widen(fs, fs->FAT, fat_len / fat_entry_size(fs));
+
+	fs->fat_dirty = calloc(fs->superblock.n_FAT_blks, sizeof(uint8_t));
+	if (!fs->fat_dirty)
+	{
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+
+	// root entries are still in meta_buf, the datablocks a version 2
+	// directory grew into are chained through the FAT
+	if (dir_loader(fs) == -1)
+	{
+		free(fs->fat_dirty);
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+
+	if (free_map_builder(fs) == -1)
+	{
+		dir_release(fs);
+		free(fs->fat_dirty);
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+	if (name_index_builder(fs, NAME_HASH_BUCKETS) == -1)
+	{
+		free(fs->free_map);
+		dir_release(fs);
+		free(fs->fat_dirty);
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
+	}
+
+	// metadata was loaded without delay, batch disk requests from now on
+	if (disk_set_window(fs->disk, fs->sched_window_us) == -1)
+	{
+		free(fs->free_map);
+		dir_release(fs);
+		free(fs->fat_dirty);
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
+		return -1;
 	}
 
-	// read Root entries
-	if (block_read(superblock.root_dir_index, root) == -1)
+	// data blocks are accessed through the block cache of this disk
+	fs->cache = cache_open(fs->disk, fs->cache_size);
+	if (!fs->cache)
 	{
-		free(FAT);
+		free(fs->free_map);
+		dir_release(fs);
+		free(fs->fat_dirty);
+		free(fs->FAT);
+		fat_pager_release(fs);
+		free(fs->meta_buf);
+		disk_close(fs->disk);
 		return -1;
 	}
 	for (int i = 0; i < MAX_FD; ++i)
-		fd_table[i].is_free = 1; // mark every in fd_table as free
-	
+	{
+		fs->fd_table[i].is_free = 1; // mark every in fd_table as free
+		fs->open_files[i].file_index = -1;
+		pthread_mutex_init(&fs->fd_table[i].lock, NULL);
+		pthread_mutex_init(&fs->open_files[i].lock, NULL);
+	}
+	pthread_rwlock_init(&fs->lock, NULL);
+	pthread_mutex_init(&fs->aio_lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fs->mount_time_ns = (end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec);
 	return 0; //everything was succesful
 }
 
-int fs_umount(void)
+void fs_format_init(struct fs_format_options *opts)
 {
-	//update FAT entries
-	for (int i = 0; i < superblock.n_FAT_blks; i++)
-	{   // write to i+1, since the first blk is superblock
-		if ( block_write(i+1, (void*)FAT+(i*BLOCK_SIZE)) == -1)
-		{
-			free(FAT);
-			return -1;
-		}
+	memset(opts, 0, sizeof(*opts));
+	opts->version = FS_VERSION_1;
+	opts->block_size = DEFAULT_BLOCK_SIZE;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, const struct fs_format_options *opts)
+{
+	struct fs_format_options defaults;
+	if (!opts)
+	{
+		fs_format_init(&defaults);
+		opts = &defaults;
 	}
-	
-	// update root entries
-	if (block_write(superblock.root_dir_index, root) == -1)
+
+	size_t entry_size, max_blks;
+	if (opts->version == FS_VERSION_1)
+	{
+		entry_size = sizeof(uint16_t);
+		max_blks = MAX_BLKS_V1;
+	}
+	else if (opts->version == FS_VERSION_2)
+	{
+		entry_size = sizeof(uint32_t);
+		max_blks = MAX_BLKS_V2;
+	}
+	else
+		return -1; // unknown format
+
+	// version 1 volumes always have the block size of ECS150FS
+	size_t block_size = opts->block_size;
+	if (block_size < FS_BLOCK_SIZE_MIN || block_size > FS_BLOCK_SIZE_MAX
+	    || (block_size & (block_size - 1))
+	    || (opts->version == FS_VERSION_1 && block_size != DEFAULT_BLOCK_SIZE))
+		return -1;
+
+	// superblock, one FAT entry per data block, root directory, data blocks
+	if (data_blocks == 0 || data_blocks > max_blks)
+		return -1;
+	struct superblock_t sb = { .version = opts->version, .block_size = block_size };
+	sb.n_FAT_blks = (data_blocks * entry_size + block_size - 1) / block_size;
+	sb.root_dir_index = 1 + sb.n_FAT_blks;
+	sb.data_blk_start_index = sb.root_dir_index + root_blk_count(&sb);
+	sb.n_data_blks = data_blocks;
+	if (data_blocks > max_blks - sb.data_blk_start_index)
+		return -1;
+	sb.n_blks = sb.data_blk_start_index + data_blocks;
+
+	// the new disk reads as zeros: every FAT entry is free and every root
+	// entry is empty, except for datablock 0 which is never used
+	uint8_t* blk = malloc(MAX(block_size, SUPER_BLOCK_SIZE));
+	if (!blk)
+		return -1;
+	struct disk* disk = disk_create(diskname, sb.n_blks, BLOCK_BACKEND_FD, block_size);
+	if (!disk)
 	{
-		free(FAT);
+		free(blk);
 		return -1;
 	}
-	free(FAT);
-	block_disk_close(); 
-	return 0; //everything was sucessful
+	memset(blk, 0, MAX(block_size, SUPER_BLOCK_SIZE));
+	superblock_encode(&sb, blk);
+	int ret = disk_write(disk, 0, blk);
+	memset(blk, 0, block_size);
+	if (opts->version == FS_VERSION_1)
+		*(uint16_t*)blk = FAT_EOC_V1;
+	else
+		*(uint32_t*)blk = FAT_EOC;
+	if (ret == 0)
+		ret = disk_write(disk, 1, blk);
+	if (disk_close(disk) == -1)
+		ret = -1;
+	free(blk);
+	return ret;
 }
- 
 
-int fs_info(void)
+void fs_options_init(struct fs_options *opts)
 {
-	
-	uint8_t root_dir_free_count = 0;  // num of free directories in root
-	for (uint8_t i = 0; i < (uint8_t) FS_FILE_MAX_COUNT; i++) 
+	memset(opts, 0, sizeof(*opts));
+	opts->cache_blocks = CACHE_DEFAULT_BLOCKS;
+	opts->readahead_blocks = CACHE_PREFETCH_MAX;
+	opts->aio_threads = AIO_DEFAULT_THREADS;
+}
+
+struct fs *fsi_mount(const char *diskname, const struct fs_options *opts)
+{
+	struct fs_options defaults;
+	if (!opts)
 	{
-		if (root[i].filename[0] == '\0') 
-			root_dir_free_count++;
+		fs_options_init(&defaults);
+		opts = &defaults;
 	}
-	
 
-	int num_free_blks = 0;
-	//read each entry from FAT
-	
-	for (uint16_t i =1; i < superblock.n_data_blks; i++) // i=1, since first entry is always FAT_EOC
+	// nobody else knows about the new FS yet, no need to lock it
+	struct fs* fs = calloc(1, sizeof(struct fs));
+	if (!fs)
+		return NULL;
+	fs->cache_size = opts->cache_blocks;
+	fs->delalloc_max_blks = opts->delayed_alloc_blocks;
+	fs->sync_mode = opts->sync_mode;
+	fs->readahead_max_blks = MIN(opts->readahead_blocks, CACHE_PREFETCH_MAX);
+	fs->aio_threads = opts->aio_threads;
+	fs->sched_window_us = opts->sched_window_us;
+	fs->fat_max_blks = opts->fat_cache_blocks;
+	// a paged FAT is already used to load the directory
+	pthread_mutex_init(&fs->fat_lock, NULL);
+
+	if (fs_mount_disk(fs, diskname, opts->mmap ? BLOCK_BACKEND_MMAP : BLOCK_BACKEND_FD) == -1)
+	{
+		pthread_mutex_destroy(&fs->fat_lock);
+		free(fs);
+		return NULL;
+	}
+	return fs;
+}
+
+static int fs_umount_locked(struct fs *fs)
+{
+	// give a place on disk to buffered blocks, then write back cached data blocks
+	int ret = delalloc_flush_all(fs);
+	if (cache_flush(fs->cache) == -1)
+		ret = -1;
+
+	// update FAT and root entries that changed, unless they could point to
+	// data that didn't make it to disk. The cache stays open meanwhile, since
+	// loading a FAT block to write it back can evict another one
+	if (ret == 0 && (metadata_writeback(fs) == -1 || disk_sync(fs->disk) == -1))
+		ret = -1;
+	if (cache_close(fs->cache) == -1)
+		ret = -1;
+
+	for (int i = 0; i < MAX_FD; ++i)
 	{
-		if (FAT[i] == 0) // Entries marked as 0 correspond to free data blocks
-			num_free_blks++;
+		free(fs->open_files[i].skip);
+		free(fs->open_files[i].pending);
+		pthread_mutex_destroy(&fs->fd_table[i].lock);
+		pthread_mutex_destroy(&fs->open_files[i].lock);
 	}
+	free(fs->free_map);
+	dir_release(fs);
+	free(fs->fat_dirty);
+	free(fs->FAT);
+	fat_pager_release(fs);
+	free(fs->meta_buf);
+	disk_close(fs->disk);
+	return ret;
+}
+
+int fsi_umount(struct fs *fs)
+{
+	// requests in flight need the FS lock to finish
+	if (fs->aio)
+		aio_close(fs->aio);
+	pthread_mutex_destroy(&fs->aio_lock);
+
+	// the FS goes away even when writing it back fails
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_umount_locked(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	pthread_rwlock_destroy(&fs->lock);
+	pthread_mutex_destroy(&fs->fat_lock);
+	free(fs);
+	return ret;
+}
+ 
+
+static int fs_info_locked(struct fs *fs)
+{
+	
+	// num of free entries in root, which only grows on version 2
+	uint32_t root_dir_free_count = fs->n_root_entries - fs->n_files;
+
+	// free datablocks are counted by the free-space bitmap, which a paged
+	// FAT fills for the whole disk first
+	int num_free_blks = free_blk_counter(fs, UINT32_MAX);
 	fprintf(stdout, "FS Info:\n");
-	fprintf(stdout,"total_blk_count=%u\n", superblock.n_blks);
-	fprintf(stdout,"fat_blk_count=%u\n", superblock.n_FAT_blks);
-	fprintf(stdout,"rdir_blk=%u\n", superblock.root_dir_index);
-	fprintf(stdout,"data_blk=%u\n", superblock.data_blk_start_index);
-	fprintf(stdout,"data_blk_count=%u\n", superblock.n_data_blks);
-	fprintf(stdout,"fat_free_ratio=%u/%u\n", num_free_blks, superblock.n_data_blks);
-	fprintf(stdout,"rdir_free_ratio=%u/%u\n", root_dir_free_count, FS_FILE_MAX_COUNT);
+	fprintf(stdout,"total_blk_count=%u\n", fs->superblock.n_blks);
+	fprintf(stdout,"fat_blk_count=%u\n", fs->superblock.n_FAT_blks);
+	fprintf(stdout,"rdir_blk=%u\n", fs->superblock.root_dir_index);
+	fprintf(stdout,"data_blk=%u\n", fs->superblock.data_blk_start_index);
+	fprintf(stdout,"data_blk_count=%u\n", fs->superblock.n_data_blks);
+	fprintf(stdout,"fat_free_ratio=%u/%u\n", num_free_blks, fs->superblock.n_data_blks);
+	fprintf(stdout,"rdir_free_ratio=%u/%u\n", root_dir_free_count, fs->n_root_entries);
 	
 	return 0;
 }
 
+int fsi_info(struct fs *fs)
+{
+	// exclusive, since the free-space bitmap may have to be filled
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_info_locked(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
 
 // ======= PHASE 2   ====================================================================================
 
 
-int fs_create(const char *filename)
+static int fs_create_locked(struct fs *fs, const char *filename, int is_dir)
 {
-	/* create new empty file named filename in the root directory */
+	/* create new empty file or directory at path filename */
 
-	if (block_disk_count() == -1)
-		// no disk is open
+	uint32_t parent;
+	const char* name;
+	size_t len;
+	if (path_locator(fs, filename, &parent, &name, &len) == -1)
+		// invalid path, or a directory on the way doesn't exist
 		return -1;
+	if (is_dir && fs->superblock.version == FS_VERSION_1)
+		return -1; // no directories in version 1
 
-	int count = 0;
-	if(filename == NULL || filename[strlen(filename)] != '\0' || strlen(filename) > FS_FILENAME_LEN){
+	if (entry_locator(fs, parent, name, len) != -1)
+		// file named @filename already exists
 		return -1;
-	}
-
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(strlen(root[i].filename) != 0) {
-			if(strcmp(root[i].filename, filename) == 0) {
-				// file named @filename already exists
-				return -1;
-			}
-			else {
-				count += 1;
-			}
-		}
-		if(count == FS_FILE_MAX_COUNT) {
-			// root already contains %FS_FILE_MAX_COUNT
-			return -1;
-		}
-	}
 	
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root[i].filename[0] == '\0') { // look for empty entry
-
-			/* empty file, would have its size be 0, 
-			and the index of the first data block be FAT_EOC. */
-			memcpy(root[i].filename,filename,sizeof(root[i].filename));
-			root[i].file_size = 0;
-			root[i].idx_first_blk = FAT_EOC;
-			// update root entries
-			if (block_write(superblock.root_dir_index, root) == -1)
-				// if failed to update root
-				return -1;
-			break;
-		}
-	}
+	// look for empty entry from the first one that may be free
+	uint32_t i = fs->root_free_hint;
+	while (i < fs->n_root_entries && fs->root[i].filename[0] != '\0')
+		i++;
+	if (i == fs->n_root_entries
+	    && (fs->superblock.version == FS_VERSION_1 || dir_grow(fs) == -1))
+		// root already contains %FS_FILE_MAX_COUNT, or the disk is full
+		return -1;
+	fs->root_free_hint = i + 1;
+
+	/* empty file, would have its size be 0, 
+	and the index of the first data block be FAT_EOC. */
+	memset(fs->root[i].filename, 0, sizeof(fs->root[i].filename));
+	memcpy(fs->root[i].filename, name, len);
+	fs->root[i].file_size = 0;
+	fs->root[i].idx_first_blk = FAT_EOC;
+	fs->root[i].parent = parent;
+	fs->root[i].is_dir = is_dir;
+	fs->root[i].n_children = 0;
+	if (parent != DIR_ROOT)
+		fs->root[parent - 1].n_children++;
+	name_index_insert(fs, i);
+	root_entry_dirty(fs, i);
+	fs->n_files++;
+	// keep hash chains short, a failure only makes lookups slower
+	if (2 * (size_t)fs->n_files > fs->n_name_buckets)
+		name_index_builder(fs, 2 * fs->n_name_buckets);
+	// update root entries now only in synchronous mode,
+	// fs_sync or fs_umount will do it otherwise
+	if (fs->sync_mode && metadata_writeback(fs) == -1)
+		// if failed to update root
+		return -1;
 	return 0;
 }
 
-int fs_delete(const char *filename)
+int fsi_create(struct fs *fs, const char *filename)
 {
-	
-	if (block_disk_count() == -1)
-		// no disk is open
-		return -1;
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_create_locked(fs, filename, 0);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
 
-	if(filename == NULL || filename[strlen(filename)] != '\0' || strlen(filename) > FS_FILENAME_LEN){
-		// invalid filename
-		return -1; 
-	}
+int fsi_mkdir(struct fs *fs, const char *path)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_create_locked(fs, path, 1);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
 
-	int file_idx = file_locator(filename);
+static int fs_delete_locked(struct fs *fs, const char *filename)
+{
+	int file_idx = file_locator(fs, filename);
 	if (file_idx == -1)
-		return -1;  // no such file exists
+		return -1;  // invalid path, or no such file exists
+	if (fs->root[file_idx].is_dir && fs->root[file_idx].n_children)
+		return -1; // directory isn't empty
 	
 	for (int i =0; i < MAX_FD; i++)
 	{
-		if (!strcmp(root[file_idx].filename, fd_table[i].file_name))
-		{  // one of entries in FD table, matches this filename
-
-			if (!fd_table[i].is_free)
-			{
-				// printf("Can't remove the file. The file is still Open\n");
-				return -1;
-			}
+		if (!fs->fd_table[i].is_free && fs->fd_table[i].file_index == file_idx)
+		{  // one of entries in FD table refers to this file
+			// printf("Can't remove the file. The file is still Open\n");
+			return -1;
 		}
 	}
 
 
-	uint16_t data_index = FAT_EOC;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp(root[i].filename, filename) == 0) {
-			//free the root entry
-			data_index = root[i].idx_first_blk;
-			root[i].filename[0] = '\0';// if entry doesn't contain file, then first char will be NULL
-			root[i].file_size = 0;
-			root[i].idx_first_blk = FAT_EOC;
-			block_write(superblock.root_dir_index,&root);
-			break;
-		}
-	}
+	//free the root entry
+	uint32_t data_index = fs->root[file_idx].idx_first_blk;
+	name_index_remove(fs, file_idx);
+	if (fs->root[file_idx].parent != DIR_ROOT)
+		fs->root[fs->root[file_idx].parent - 1].n_children--;
+	fs->root[file_idx].filename[0] = '\0';// if entry doesn't contain file, then first char will be NULL
+	fs->root[file_idx].file_size = 0;
+	fs->root[file_idx].idx_first_blk = FAT_EOC;
+	fs->root[file_idx].parent = DIR_ROOT;
+	fs->root[file_idx].is_dir = 0;
+	root_entry_dirty(fs, file_idx);
+	fs->n_files--;
+	if ((uint32_t)file_idx < fs->root_free_hint)
+		fs->root_free_hint = file_idx;
 
 	// free Data blocks by setting their FAT to 0
-	uint16_t next_data_index = data_index;
-	uint16_t next = data_index;
+	uint32_t next_data_index = data_index;
+	uint32_t next = data_index;
 	while(next != FAT_EOC){ // loop until we reach end-of-file
-		next_data_index = FAT[next];
-		FAT[next] = 0;
+		next_data_index = fat_get(fs, next);
+		fat_set(fs, next, 0);
+		free_map_update(fs, next, 1);
+		// cached content of a freed block doesn't need to reach the disk
+		cache_invalidate(fs->cache, next + fs->superblock.data_blk_start_index);
 		next = next_data_index;
 	}
+
+	if (fs->sync_mode && metadata_writeback(fs) == -1)
+		return -1;
 	return 0;
 }
 
-int fs_ls(void)
+int fsi_delete(struct fs *fs, const char *filename)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_delete_locked(fs, filename);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_ls_locked(struct fs *fs)
 {
 	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root[i].filename[0] != '\0') {
-			printf("file: %s, size: %i, data_blk: %i\n", root[i].filename, root[i].file_size, root[i].idx_first_blk);
+	for (uint32_t i = 0; i < fs->n_root_entries; i++) {
+		if (fs->root[i].filename[0] != '\0') {
+			// files in directories are listed with their path
+			char* path = entry_path(fs, i);
+			if (!path)
+				return -1;
+			uint32_t first_blk = fs->root[i].idx_first_blk;
+			if (first_blk == FAT_EOC && fs->superblock.version == FS_VERSION_1)
+				first_blk = FAT_EOC_V1; // as it is stored on disk
+			if (fs->root[i].is_dir)
+				printf("dir: %s\n", path);
+			else
+				printf("file: %s, size: %llu, data_blk: %u\n", path,
+				       (unsigned long long)fs->root[i].file_size, first_blk);
+			free(path);
 		}
 	}
 	return 0;
 }
 
+int fsi_ls(struct fs *fs)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+	int ret = fs_ls_locked(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
 // ======= PHASE 3   ====================================================================================
 
 // properly set FD, then return it
-int fs_open(const char *filename)
+static int fs_open_locked(struct fs *fs, const char *filename)
 {
-	if (block_disk_count() == -1)
-		// no disk is open
-		return -1;
-	
-	if (strlen(filename) > FS_FILENAME_LEN)
-	{
-		// printf("file name is too long\n");
-		return -1;
-	}
-
-	int f_index = file_locator(filename);
-	if (f_index == -1)
+	int f_index = file_locator(fs, filename);
+	if (f_index == -1 || fs->root[f_index].is_dir)
 	{
 		// printf("There is no such file with name %s\n", filename);
 		return -1;
@@ -298,12 +883,18 @@ int fs_open(const char *filename)
 	
 	for( uint8_t i = 0; i < MAX_FD; i++)
 	{
-		if (fd_table[i].is_free)
+		if (fs->fd_table[i].is_free)
 		{
 			// we found free FS entry
-			fd_table[i].is_free = 0;  // this FD entry is no longer free
-			fd_table[i].offset =  0; // start from the begining of the file
-			strcpy(fd_table[i].file_name, filename);
+			fs->fd_table[i].is_free = 0;  // this FD entry is no longer free
+			fs->fd_table[i].offset =  0; // start from the begining of the file
+			fs->fd_table[i].file_index = f_index;
+			fs->fd_table[i].file = open_file_locator(fs, f_index);
+			fs->fd_table[i].cursor.blk = 0;
+			fs->fd_table[i].cursor.phys = FAT_EOC; // no block reached yet
+			fs->fd_table[i].ra_next_blk = 0;
+			fs->fd_table[i].ra_window = 0;
+			fs->fd_table[i].ra_end_blk = 0;
 			return i;
 		}
 	}
@@ -313,290 +904,2428 @@ int fs_open(const char *filename)
 
 }
 
-int fs_close(int fd)
+int fsi_open(struct fs *fs, const char *filename)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_open_locked(fs, filename);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_close_locked(struct fs *fs, int fd)
 {
-	if (block_disk_count() == -1)
-		return -1;
 	
-	if (fd >= MAX_FD)
-	{
-		//printf("Invalid FD\n");
+	if (fd >= MAX_FD || fd < 0)
 		return -1;
-	}
 	
-	if (fd_table[fd].is_free)
+	if (fs->fd_table[fd].is_free)
 	{
 		// printf("the file with FD=%d is already closed\n", fd);
 		return -1;
 	}
 
-	if (file_locator(fd_table[fd].file_name) == -1)
+	// buffered blocks get their datablocks when the file is closed
+	if (fs->fd_table[fd].file->n_open == 1 && delalloc_flush(fs, fs->fd_table[fd].file) == -1)
 		return -1;
-	
+
 	/* reset FD entry */
-	fd_table[fd].is_free = 1;
-	fd_table[fd].offset = 0;
-	fd_table[fd].file_name[0] = '\0';
+	open_file_release(fs->fd_table[fd].file);
+	fs->fd_table[fd].file = NULL;
+	fs->fd_table[fd].is_free = 1;
+	fs->fd_table[fd].offset = 0;
+	fs->fd_table[fd].file_index = -1;
 	return 0; //success
 
 }
 
-int fs_stat(int fd)
+int fsi_close(struct fs *fs, int fd)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_close_locked(fs, fd);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int fsi_stat(struct fs *fs, int fd)
 {
 	/* Returns: the size of the file whom @fd is provided */
+	int ret = -1;
 
-	if ((fd >= MAX_FD) || (fd < 0))
-		return -1;
-	
-	if (fd_table[fd].is_free)
-		return -1;
-	
-	int idx = file_locator(fd_table[fd].file_name);
-	if (idx == -1)
-		// no file with such name
-		return -1;
+	uint64_t size;
 
-	return (int) root[idx].file_size;
-	
+	if (fsi_stat64(fs, fd, &size) == 0 && size <= INT_MAX)
+		ret = (int) size;
+	return ret;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fsi_stat64(struct fs *fs, int fd, uint64_t *size)
 {
-	/* sets the offset of the file to the given offset */
-	if (fs_stat(fd) == -1)
-		// either fd is invalid, or FD is not used
-		return -1;
+	int ret = -1;
 
-	if ((int) offset < 0)
-		return -1;
+	pthread_rwlock_rdlock(&fs->lock);
+	if (size && fd < MAX_FD && fd >= 0 && !fs->fd_table[fd].is_free)
+	{
+		*size = fs->root[fs->fd_table[fd].file_index].file_size;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
 
-	if (fs_stat(fd) < (int)offset)
-	// file size is less than the offset
-		return -1;
-	
-	fd_table[fd].offset = offset;
-	return 0; //sucess
+int fsi_lseek(struct fs *fs, int fd, size_t offset)
+{
+	/* sets the offset of the file to the given offset */
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	if (fd_acquire(fs, fd) == 0)
+	{
+		// file size must not be less than the offset
+		if (offset <= fs->root[fs->fd_table[fd].file_index].file_size)
+		{
+			fs->fd_table[fd].offset = offset;
+			ret = 0;
+		}
+		pthread_mutex_unlock(&fs->fd_table[fd].lock);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
 }
 
 // ======= PHASE 4  ====================================================================================
-int fs_write(int fd, void *buf, size_t count)
+int fsi_write(struct fs *fs, int fd, void *buf, size_t count)
 {
-	if (block_disk_count() == -1)
-		return -1;
-	if (fd_table[fd].is_free || fd >= MAX_FD || fd < 0)
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fsi_writev(fs, fd, &iov, 1);
+}
+
+int fsi_pwrite(struct fs *fs, int fd, const void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = count };
+
+	return fsi_pwritev(fs, fd, &iov, 1, offset);
+}
+
+static int fs_pwritev_locked(struct fs *fs, int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	if (fd >= MAX_FD || fd < 0 || fs->fd_table[fd].is_free)
 		return -1;
-	if (!buf)
+
+	struct iov_cursor src = { .iov = iov, .iovcnt = iovcnt };
+	ssize_t iov_len = iov_length(iov, iovcnt);
+	if (iov_len == -1)
 		return -1;
-	
-	uint64_t offset = fd_table[fd].offset;
-	int file_index = file_locator(fd_table[fd].file_name);
-	if (file_index == -1)
-		return -1; 
+	size_t count = iov_len;
+
+	int file_index = fs->fd_table[fd].file_index;
+	uint64_t file_size = fs->root[file_index].file_size; // before the write
+	if (offset > file_size)
+		return -1; // files can't have holes
 
-	uint8_t bounce_buf[BLOCK_SIZE];
-	size_t offset_from_blk = offset % BLOCK_SIZE;
+	size_t block_size = fs->superblock.block_size;
+	uint8_t* bounce_buf = NULL; // gathers a block spread over several buffers
+	if (iovcnt > 1 && !(bounce_buf = malloc(block_size)))
+		return -1;
+	size_t offset_from_blk;
 	size_t amount_to_write;
 	int buf_offset = 0; // tracks how many bytes we wrote
 
-	uint16_t first_blk_index = root[file_index].idx_first_blk;
-	if (first_blk_index == FAT_EOC && (count > 0)) //empty file has fist_blk as FAT_EOC
+	// when the write extends the file, pick where its new blocks go up front:
+	// right after the current last block if possible, else in a free run
+	// large enough for all of them
+	// (with delayed allocation, this is only done when the file is flushed)
+	uint32_t alloc_goal = 0;
+	uint32_t n_file_blks = (file_size + block_size - 1) / block_size;
+	uint64_t n_needed_blks = (offset + count + block_size - 1) / block_size;
+	if (n_needed_blks > n_file_blks && !fs->delalloc_max_blks)
 	{
-		// no longer empty file
-		first_blk_index = free_db_entries_locator();
-		root[file_index].idx_first_blk = first_blk_index;
-		FAT[first_blk_index] = FAT_EOC;
+		uint32_t last_blk = FAT_EOC;
+		if (n_file_blks > 0)
+			last_blk = cursor_locator(fs, fd, &fs->fd_table[fd].cursor, n_file_blks - 1);
+		fs->fd_table[fd].file->tail_blk = last_blk;
+		alloc_goal = reserve_locator(fs, fs->fd_table[fd].file, last_blk, n_needed_blks - n_file_blks);
 	}
-	// current_blk == blk where offset if located at
-	uint16_t current_blk = current_block_loactor(offset, first_blk_index);
 
-	while (1)
+	// current_blk == blk where offset if located at. It is FAT_EOC when the
+	// offset is right past the last block of the file (or file is empty),
+	// then the FD cursor is left on the last block of the file
+	uint32_t current_blk = cursor_locator(fs, fd, &fs->fd_table[fd].cursor, offset / block_size);
+	uint32_t prev_blk = fs->fd_table[fd].cursor.phys;
+
+	while (count > 0)
 	{
-		if (offset_from_blk != 0)
+		if (current_blk == FAT_EOC && fs->delalloc_max_blks)
 		{
-			/* case 1: offset is not at the begining of block*/
-			amount_to_write = MIN(count, BLOCK_SIZE);
-			if (amount_to_write == BLOCK_SIZE)
-				amount_to_write -= offset_from_blk;
-			else if ((amount_to_write + offset_from_blk) > BLOCK_SIZE)
-				amount_to_write = BLOCK_SIZE - offset_from_blk;
+			/* delayed allocation: data past the end of the chain is
+			   buffered until the file is flushed */
+			offset_from_blk = offset % block_size;
+			amount_to_write = MIN(count, block_size - offset_from_blk);
+			if (delalloc_write(fs, fs->fd_table[fd].file, offset / block_size, offset_from_blk,
+					   amount_to_write, iov_gather(&src, amount_to_write, bounce_buf)) == -1)
+				//no more space left in the disk
+				break;
+			offset += amount_to_write;
+			buf_offset += amount_to_write;
+			count -= amount_to_write;
+			continue;
+		}
 
-			block_read(current_blk, bounce_buf); //read into bounce_buffer
-			memcpy(bounce_buf + offset_from_blk, buf+buf_offset ,amount_to_write );
-			block_write(current_blk, bounce_buf); //write bounce into file
+		if (current_blk == FAT_EOC)
+		{ // extend file size if reached end of the file
+			int free_blk_index = block_allocator(fs, fs->fd_table[fd].file, prev_blk, alloc_goal);
+			if (free_blk_index == -1)
+				//no more space left in the disk
+				break ;
+			current_blk = free_blk_index;
+			alloc_goal = current_blk + 1;
 		}
-		else if (count < BLOCK_SIZE)
+
+		offset_from_blk = offset % block_size;
+		size_t n_contig = MIN(count, iov_contig(&src)); // bytes in the current buffer
+		if (offset_from_blk == 0 && n_contig >= block_size)
 		{
-			/* case 2: less than a block to write and 
-				offset aligned with block*/
+			/* offset is aligned and at least a block left in the current
+			   buffer: gather as many physically consecutive blocks as 
+			   possible (extending the file if needed) and write them 
+			   with a single request */
+			size_t n_blks = 1;
+			uint32_t last_blk = current_blk;
+			while (n_blks < n_contig / block_size)
+			{
+				uint32_t next_blk = fat_get(fs, last_blk);
+				if (next_blk == FAT_EOC && fs->delalloc_max_blks)
+					break; // the rest is buffered, see above
+				if (next_blk == FAT_EOC)
+				{
+					int new_blk = block_allocator(fs, fs->fd_table[fd].file, last_blk, alloc_goal);
+					if (new_blk == -1)
+						break; // disk is full
+					next_blk = new_blk;
+					alloc_goal = next_blk + 1;
+				}
+				if (next_blk != last_blk + 1)
+					break; // chain isn't contiguous
+				last_blk = next_blk;
+				n_blks++;
+			}
 
-			block_read(current_blk, bounce_buf);
-			amount_to_write = count;
-			memcpy(bounce_buf, buf + buf_offset, amount_to_write);
-			block_write(current_blk, bounce_buf); // update block
+			if (cache_write_run(fs->cache, current_blk + fs->superblock.data_blk_start_index,
+					    n_blks, iov_gather(&src, n_blks * block_size, NULL)) == -1)
+				break;
+			amount_to_write = n_blks * block_size;
+			current_blk = last_blk;
 		}
 		else
 		{
-			/* case 3: offset is aligned and at least a block left*/
-			block_write(current_blk, buf + buf_offset); // update file block
-			amount_to_write = BLOCK_SIZE; 
+			/* partial blocks are merged into the cached copy of the
+			   block. Pieces of a block coming from several buffers are
+			   gathered first, so that a block they cover entirely is 
+			   written without being read */
+			amount_to_write = MIN(count, block_size - offset_from_blk);
+			const void* data = iov_gather(&src, amount_to_write, bounce_buf);
+
+			/* the block doesn't need to be read either when it holds no
+			   file data yet (new block, past the end of the file), or 
+			   when the write covers all the file data it holds */
+			uint64_t blk_start = offset - offset_from_blk;
+			size_t n_used = file_size > blk_start ? MIN(file_size - blk_start, block_size) : 0;
+			int ret;
+			if (n_used == 0 || (offset_from_blk == 0 && amount_to_write >= n_used))
+				ret = cache_overwrite(fs->cache, current_blk + fs->superblock.data_blk_start_index,
+						      offset_from_blk, amount_to_write, data);
+			else
+				ret = cache_write(fs->cache, current_blk + fs->superblock.data_blk_start_index,
+						  offset_from_blk, amount_to_write, data);
+			if (ret == -1)
+				break;
 		}
 
 		offset += amount_to_write;
 		buf_offset += amount_to_write;
 		count -= amount_to_write;
-		offset_from_blk = offset % BLOCK_SIZE;
 
-		if (count == 0)
-			break;
+		// remember where we stopped, for the next call on this FD
+		fs->fd_table[fd].cursor.blk = (offset - 1) / block_size;
+		fs->fd_table[fd].cursor.phys = current_blk;
+		prev_blk = current_blk;
+		current_blk = fat_get(fs, current_blk); // jump to next block of file
+	}
+	//update file size
+	if (offset > fs->root[file_index].file_size)
+	{
+		fs->root[file_index].file_size = offset;
+		root_entry_dirty(fs, file_index);
+	}
 
-		if (FAT[current_blk] == FAT_EOC)
-		{ // extend file size if reached end of the file
+	// too many blocks buffered, place them on disk now
+	if (fs->n_delalloc_blks > fs->delalloc_max_blks && delalloc_flush_all(fs) == -1)
+	{
+		// buffered blocks were lost: when the file was cut inside this
+		// write, the part before the cut is still written
+		size_t start = offset - buf_offset;
+		uint64_t file_size = fs->root[file_index].file_size;
+		buf_offset = (file_size > start && file_size < offset) ? (int)(file_size - start) : -1;
+	}
+	free(bounce_buf);
+	return buf_offset;
+}
 
-			int free_blk_index = free_db_entries_locator();
-			if (free_blk_index == -1)
-				//no more space left in the disk
-				break ;
-			FAT[current_blk] = free_blk_index;
-			FAT[free_blk_index] = FAT_EOC; 
-		}
+int fsi_pwritev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_pwritev_locked(fs, fd, iov, iovcnt, offset);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int fsi_writev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+	int ret = -1;
 
-		current_blk = FAT[current_blk]; // jump to next block of file
-		
+	pthread_rwlock_wrlock(&fs->lock);
+	if (fd < MAX_FD && fd >= 0 && !fs->fd_table[fd].is_free)
+	{
+		ret = fs_pwritev_locked(fs, fd, iov, iovcnt, fs->fd_table[fd].offset);
+		if (ret > 0)
+			fs->fd_table[fd].offset += ret;
 	}
-	//update file size
-	root[file_index].file_size += buf_offset;
-	fd_table[fd].offset = offset;
-	return buf_offset;
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fsi_read(struct fs *fs, int fd, void *buf, size_t count)
 {
 	/* read @count bytes of data from file into @buf
 		returns : num of bytes read  */
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-	uint64_t offset = 	fd_table[fd].offset;
-	uint16_t offset_from_blk = offset % BLOCK_SIZE;
-	uint8_t bounce_buf[BLOCK_SIZE];
+	return fsi_readv(fs, fd, &iov, 1);
+}
 
-	uint32_t file_size;
+int fsi_pread(struct fs *fs, int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fsi_preadv(fs, fd, &iov, 1, offset);
+}
+
+static int fs_preadv_locked(struct fs *fs, int fd, const struct iovec *iov, int iovcnt, size_t offset,
+			    struct chain_cursor *cursor)
+{
+	/* reads from offset, walking the chain from cursor, which is left on
+	the last block read. Nothing else of the FD is touched */
+	uint64_t file_size;
+	size_t offset_from_blk;
 	size_t amount_to_read;
 	int buf_offset = 0; // tracks how many bytes we read
+	uint8_t* bounce_buf = NULL; // holds a block spread over several buffers
 	
 
-	if (block_disk_count() == -1)
-		return -1;
 	
-	if (fd_table[fd].is_free || fd >= MAX_FD || fd < 0)
+	if (fd >= MAX_FD || fd < 0 || fs->fd_table[fd].is_free)
 		return -1;
 
-	if (!buf)
+	struct iov_cursor dst = { .iov = iov, .iovcnt = iovcnt };
+	ssize_t iov_len = iov_length(iov, iovcnt);
+	if (iov_len == -1)
 		return -1;
+	size_t count = iov_len;
 	
-	int file_index = file_locator(fd_table[fd].file_name);
-	if (file_index == -1)
-		return -1;
-	
-	int current_blk = current_block_loactor(offset, root[file_index].idx_first_blk);
-	
-	
-	file_size = root[file_index].file_size;
+	int file_index = fs->fd_table[fd].file_index;
+	file_size = fs->root[file_index].file_size;
+	if (offset >= file_size)
+		return 0;
 	if ((offset + count) > file_size)
 		// reduce number of bytes to be read, since we reaching end of file
 		count = file_size - offset;
+	if (count == 0)
+		return 0;
+	size_t block_size = fs->superblock.block_size;
+	if (iovcnt > 1 && !(bounce_buf = malloc(block_size)))
+		return -1;
+
+	uint32_t current_blk = cursor_locator(fs, fd, cursor, offset / block_size);
 	
 	while (count > 0)
 	{
-		if (offset_from_blk != 0)
+		offset_from_blk = offset % block_size;
+		size_t n_contig = MIN(count, iov_contig(&dst)); // room in the current buffer
+		if (current_blk == FAT_EOC)
 		{
-			/* case 1: offset is not at the begining of block */
-			amount_to_read = MIN(count, BLOCK_SIZE); // don't read more than a block
-			if (amount_to_read == BLOCK_SIZE)
-				amount_to_read -= offset_from_blk;
-			else if ((amount_to_read + offset_from_blk) > BLOCK_SIZE)
-				amount_to_read = BLOCK_SIZE - offset_from_blk;
-
-			block_read(current_blk, bounce_buf);
-			memcpy(buf+buf_offset, bounce_buf + offset_from_blk, amount_to_read);
+			// past the end of the chain: block buffered by delayed allocation
+			amount_to_read = MIN(count, block_size - offset_from_blk);
+			uint8_t* to = n_contig >= amount_to_read ? iov_base(&dst) : bounce_buf;
+			delalloc_read(fs->fd_table[fd].file, offset / block_size, offset_from_blk,
+				      amount_to_read, to);
+			iov_scatter(&dst, amount_to_read, to);
+			offset += amount_to_read;
+			buf_offset += amount_to_read;
+			count -= amount_to_read;
+			continue;
 		}
-		else if (count < BLOCK_SIZE)
-		{
-			// case 2: less than a block  to read and offset aligned with block
-			block_read(current_blk, bounce_buf);
-			amount_to_read = count;
-			memcpy(buf+buf_offset, bounce_buf, amount_to_read);
 
+		if (offset_from_blk == 0 && n_contig >= block_size)
+		{
+			/* offset is aligned to begining of block: read the whole
+			   physically contiguous part of the chain at once */
+			size_t n_blks = contiguous_run_locator(fs, current_blk, n_contig / block_size);
+			if (cache_read_run(fs->cache, current_blk + fs->superblock.data_blk_start_index,
+					   n_blks, iov_base(&dst)) == -1)
+				break;
+			amount_to_read = n_blks * block_size;
+			iov_scatter(&dst, amount_to_read, iov_base(&dst));
+			current_blk += n_blks - 1;
 		}
-		else {
-			// case 3: offset is aligned to begining of block
-			block_read(current_blk, buf+buf_offset);
-			amount_to_read = BLOCK_SIZE;
+		else
+		{
+			amount_to_read = MIN(count, block_size - offset_from_blk); // don't read more than a block
+			uint8_t* to = n_contig >= amount_to_read ? iov_base(&dst) : bounce_buf;
+			if (cache_read(fs->cache, current_blk + fs->superblock.data_blk_start_index,
+				       offset_from_blk, amount_to_read, to) == -1)
+				break;
+			iov_scatter(&dst, amount_to_read, to);
 		}
+
 		offset += amount_to_read;
 		buf_offset += amount_to_read;
 		count -= amount_to_read;
-		offset_from_blk = offset % BLOCK_SIZE;
-		if (FAT[current_blk] == FAT_EOC)
-			break; // end of file
-		current_blk = FAT[current_blk]; // jump to next block of the file
+
+		// remember where we stopped, for the next call
+		cursor->blk = (offset - 1) / block_size;
+		cursor->phys = current_blk;
+		current_blk = fat_get(fs, current_blk); // jump to next block of the file
 	}
-	
-	// loop finished
-	fd_table[fd].offset = offset; // update file offset
+
+	free(bounce_buf);
 	return buf_offset; // # of bytes that we read
 }
 
-/* ==========  HELPER FUNCTIONS  ======================================= */
-int file_locator(const char* fname)
+int fsi_readv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt)
 {
-	/* PARAMETRS
-		fname: name of the file to search for 
-
-	   RETURN:
-		the position of the file in the root directory that matches fname,
-		 otherwise returns -1.
-	*/
+	int ret = -1;
 
-	for (uint16_t i =0; i < FS_FILE_MAX_COUNT; ++i)
+	// readers share the FS, the FD itself is used by one of them at a time
+	pthread_rwlock_rdlock(&fs->lock);
+	if (fd_acquire(fs, fd) == 0)
 	{
-		if (!strncmp(root[i].filename, fname, FS_FILENAME_LEN))
-			return i;
+		struct file_descriptor_t* desc = &fs->fd_table[fd];
+		ret = fs_preadv_locked(fs, fd, iov, iovcnt, desc->offset, &desc->cursor);
+		if (ret > 0)
+		{
+			readahead(fs, fd, desc->offset / fs->superblock.block_size, desc->offset + ret, &desc->cursor);
+			desc->offset += ret;
+		}
+		pthread_mutex_unlock(&desc->lock);
 	}
-	return -1;
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
 }
 
-
-int current_block_loactor(uint64_t offset,  int first_blk_index)
+int fsi_preadv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt, size_t offset)
 {
-	/* calculates at which datablock the offset of 
-	the file is located at   
-	PARAMTERS:
-		offset: offset of the file
-		first_blk_index: index of first data block of the file
-	*/
-	int idx = first_blk_index;
-	int blocks_to_jump = offset/BLOCK_SIZE;
-	for (int i = 0; i < blocks_to_jump; i++)
+	int ret = -1;
+
+	// the data is transfered without the FD lock, so that threads sharing
+	// the FD read in parallel. The FD cursor and readahead state are only
+	// used when nobody else holds the lock: a busy FD starts the walk from
+	// the skip index and isn't read ahead
+	pthread_rwlock_rdlock(&fs->lock);
+	if (fd < MAX_FD && fd >= 0 && !fs->fd_table[fd].is_free)
 	{
-		idx = FAT[idx];
+		struct file_descriptor_t* desc = &fs->fd_table[fd];
+		struct chain_cursor cursor = { .blk = 0, .phys = FAT_EOC };
+		if (pthread_mutex_trylock(&desc->lock) == 0)
+		{
+			cursor = desc->cursor;
+			pthread_mutex_unlock(&desc->lock);
+		}
+		ret = fs_preadv_locked(fs, fd, iov, iovcnt, offset, &cursor);
+		if (ret > 0 && pthread_mutex_trylock(&desc->lock) == 0)
+		{
+			desc->cursor = cursor;
+			readahead(fs, fd, offset / fs->superblock.block_size, offset + ret, &cursor);
+			pthread_mutex_unlock(&desc->lock);
+		}
 	}
-	return idx + superblock.data_blk_start_index;
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_view_open_locked(struct fs *fs, int fd, size_t offset, size_t count, struct fs_view *view)
+{
+	if (fd >= MAX_FD || fd < 0 || fs->fd_table[fd].is_free)
+		return -1;
+	if (!view)
+		return -1;
+
+	uint64_t file_size = fs->root[fs->fd_table[fd].file_index].file_size;
+	if (offset > file_size)
+		return -1;
+	if (count > file_size - offset)
+		count = file_size - offset;
 
+	// spans point into datablocks, so buffered blocks need one first
+	if (delalloc_flush(fs, fs->fd_table[fd].file) == -1)
+		return -1;
+
+	view->fs = fs;
+	view->fd = fd;
+	view->offset = offset;
+	view->end = offset + count;
+	view->blk = count ? cursor_locator(fs, fd, &fs->fd_table[fd].cursor, offset / fs->superblock.block_size) : FAT_EOC;
+	return 0;
 }
 
-int free_db_entries_locator()
+int fsi_view_open(struct fs *fs, int fd, size_t offset, size_t count, struct fs_view *view)
 {
-	/* searches the disk for free datablock entries 
-	
-	Returns:
-	the index of the first free datablock.
-	if no datablock left in the disk, returns -1
-	   */
-	for (u_int16_t i = 0; i < superblock.n_data_blks; i++)
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_view_open_locked(fs, fd, offset, count, view);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_view_next_locked(struct fs *fs, struct fs_view *view, struct fs_span *span)
+{
+	if (view->offset >= view->end)
+		return 0;
+
+	size_t offset_from_blk = view->offset % fs->superblock.block_size;
+	size_t disk_blk = view->blk + fs->superblock.data_blk_start_index;
+	const void* block;
+	int source;
+
+	/* a cached copy is the most recent content of the block, then comes
+	   the mapping of the disk, and only then the block is loaded in the
+	   cache. Blocks are copied when the cache entry can't be pinned */
+	if ((block = cache_pin(fs->cache, disk_blk, 0)))
+		source = SPAN_CACHE;
+	else if (!cache_contains(fs->cache, disk_blk) && (block = disk_map(fs->disk, disk_blk)))
+		source = SPAN_MAP;
+	else if ((block = cache_pin(fs->cache, disk_blk, 1)))
+		source = SPAN_CACHE;
+	else
 	{
-		if (FAT[i] == 0)
+		void* copy = malloc(fs->superblock.block_size);
+		if (!copy || cache_read(fs->cache, disk_blk, 0, fs->superblock.block_size, copy) == -1)
 		{
-			return i;
+			free(copy);
+			return -1;
 		}
+		block = copy;
+		source = SPAN_COPY;
+	}
+
+	span->data = (const uint8_t*)block + offset_from_blk;
+	span->len = MIN(view->end - view->offset, fs->superblock.block_size - offset_from_blk);
+	span->block = block;
+	span->source = source;
+	span->fs = fs;
+
+	view->offset += span->len;
+	if (view->offset % fs->superblock.block_size == 0)
+		view->blk = fat_get(fs, view->blk); // jump to next block of the file
+	return 1;
+}
+
+int fs_view_next(struct fs_view *view, struct fs_span *span)
+{
+	struct fs* fs = view->fs; // the view knows which FS it was opened on
+
+	pthread_rwlock_rdlock(&fs->lock);
+	int ret = fs_view_next_locked(fs, view, span);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+void fs_span_release(struct fs_span *span)
+{
+	if (span->source == SPAN_CACHE)
+		cache_unpin(span->fs->cache, span->block);
+	else if (span->source == SPAN_COPY)
+		free((void*)span->block);
+	span->block = NULL;
+	span->source = 0;
+}
+
+int fsi_set_readahead(struct fs *fs, size_t max_blocks)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	fs->readahead_max_blks = MIN(max_blocks, CACHE_PREFETCH_MAX);
+	pthread_rwlock_unlock(&fs->lock);
+	return 0;
+}
+
+static int fs_flush_locked(struct fs *fs)
+{
+	if (delalloc_flush_all(fs) == -1 || cache_flush(fs->cache) == -1)
+		return -1;
+	return disk_sync(fs->disk);
+}
+
+int fsi_flush(struct fs *fs)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_flush_locked(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_sync_locked(struct fs *fs)
+{
+	// data first, so that metadata never points to blocks not written yet
+	if (fs_flush_locked(fs) == -1 || metadata_writeback(fs) == -1)
+		return -1;
+	return disk_sync(fs->disk);
+}
+
+int fsi_sync(struct fs *fs)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int ret = fs_sync_locked(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+int fsi_set_sync_mode(struct fs *fs, int enable)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	fs->sync_mode = enable;
+	pthread_rwlock_unlock(&fs->lock);
+	return 0;
+}
+
+static int fs_fragments_locked(struct fs *fs, int fd)
+{
+	/* counts the runs of physically contiguous blocks the file is made of */
+	if (fd >= MAX_FD || fd < 0 || fs->fd_table[fd].is_free)
+		return -1;
+
+	int n_fragments = 0;
+	uint32_t blk = fs->root[fs->fd_table[fd].file_index].idx_first_blk;
+	while (blk != FAT_EOC)
+	{
+		n_fragments++;
+		blk += contiguous_run_locator(fs, blk, SIZE_MAX) - 1;
+		blk = fat_get(fs, blk);
+	}
+	return n_fragments;
+}
+
+int fsi_fragments(struct fs *fs, int fd)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+	int ret = fs_fragments_locked(fs, fd);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+static int fs_stats_locked(struct fs *fs, struct fs_stats *stats)
+{
+	struct cache_stats cstats;
+	struct iosched_stats sstats;
+
+	if (!stats)
+		return -1;
+
+	cache_get_stats(fs->cache, &cstats);
+	disk_get_sched_stats(fs->disk, &sstats);
+	stats->cache_hits = cstats.hits;
+	stats->cache_misses = cstats.misses;
+	stats->cache_evictions = cstats.evictions;
+	stats->cache_writebacks = cstats.writebacks;
+	stats->readahead_blocks = cstats.prefetches;
+	stats->mount_time_ns = fs->mount_time_ns;
+	stats->disk_requests = sstats.requests;
+	stats->disk_transfers = sstats.transfers;
+	pthread_mutex_lock(&fs->fat_lock);
+	stats->fat_loads = fs->fat_loads;
+	stats->fat_evictions = fs->fat_evictions;
+	pthread_mutex_unlock(&fs->fat_lock);
+	return 0;
+}
+
+int fsi_stats(struct fs *fs, struct fs_stats *stats)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+	int ret = fs_stats_locked(fs, stats);
+	pthread_rwlock_unlock(&fs->lock);
+	return ret;
+}
+
+// ======= ASYNCHRONOUS I/O   ==========================================================================
+
+static int fs_aio_run(void* arg)
+{
+	/* performs request arg on an I/O thread. Returns whether it must be
+	   queued for fs_aio_reap */
+	struct fs_aio* req = arg;
+
+	if (req->op == FS_AIO_READ)
+		req->result = fsi_pread(req->fs, req->fd, req->buf, req->count, req->offset);
+	else if (req->op == FS_AIO_WRITE)
+		req->result = fsi_pwrite(req->fs, req->fd, req->buf, req->count, req->offset);
+	else
+		req->result = -1;
+
+	if (!req->callback)
+		return 1;
+	req->callback(req);
+	return 0;
+}
+
+int fsi_aio_submit(struct fs *fs, struct fs_aio *req)
+{
+	if (!req)
+		return -1;
+
+	// threads are only started for FS that get asynchronous requests
+	pthread_mutex_lock(&fs->aio_lock);
+	if (!fs->aio && fs->aio_threads)
+		fs->aio = aio_open(fs->aio_threads);
+	struct aio_pool* pool = fs->aio;
+	pthread_mutex_unlock(&fs->aio_lock);
+	if (!pool)
+		return -1;
+
+	req->fs = fs;
+	return aio_submit(pool, fs_aio_run, req);
+}
+
+int fsi_aio_reap(struct fs *fs, size_t min, size_t max, struct fs_aio **reqs)
+{
+	if (!reqs)
+		return -1;
+
+	pthread_mutex_lock(&fs->aio_lock);
+	struct aio_pool* pool = fs->aio;
+	pthread_mutex_unlock(&fs->aio_lock);
+	if (!pool)
+		return 0; // nothing was ever submitted
+
+	return aio_reap(pool, min, max, (void**)reqs);
+}
+
+// ======= DEFAULT FS   ==================================================================================
+
+/* the calls without a handle work on default_fs. default_lock is held shared
+   while they run, so that fs_umount can't free it under them */
+#define DEFAULT_FS_CALL(call) \
+	int ret = -1; \
+	pthread_rwlock_rdlock(&default_lock); \
+	if (default_fs) \
+		ret = call; \
+	pthread_rwlock_unlock(&default_lock); \
+	return ret
+
+int fs_mount(const char *diskname)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs) // only one FS at a time without handles
+	{
+		default_fs = fsi_mount(diskname, &default_options);
+		if (default_fs)
+			ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (default_fs)
+	{
+		ret = fsi_umount(default_fs);
+		default_fs = NULL;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_info(void)
+{
+	DEFAULT_FS_CALL(fsi_info(default_fs));
+}
+
+int fs_create(const char *filename)
+{
+	DEFAULT_FS_CALL(fsi_create(default_fs, filename));
+}
+
+int fs_delete(const char *filename)
+{
+	DEFAULT_FS_CALL(fsi_delete(default_fs, filename));
+}
+
+int fs_mkdir(const char *path)
+{
+	DEFAULT_FS_CALL(fsi_mkdir(default_fs, path));
+}
+
+int fs_ls(void)
+{
+	DEFAULT_FS_CALL(fsi_ls(default_fs));
+}
+
+int fs_open(const char *filename)
+{
+	DEFAULT_FS_CALL(fsi_open(default_fs, filename));
+}
+
+int fs_close(int fd)
+{
+	DEFAULT_FS_CALL(fsi_close(default_fs, fd));
+}
+
+int fs_stat(int fd)
+{
+	DEFAULT_FS_CALL(fsi_stat(default_fs, fd));
+}
+
+int fs_stat64(int fd, uint64_t *size)
+{
+	DEFAULT_FS_CALL(fsi_stat64(default_fs, fd, size));
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	DEFAULT_FS_CALL(fsi_lseek(default_fs, fd, offset));
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	DEFAULT_FS_CALL(fsi_write(default_fs, fd, buf, count));
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+	DEFAULT_FS_CALL(fsi_pwrite(default_fs, fd, buf, count, offset));
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	DEFAULT_FS_CALL(fsi_writev(default_fs, fd, iov, iovcnt));
+}
+
+int fs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	DEFAULT_FS_CALL(fsi_pwritev(default_fs, fd, iov, iovcnt, offset));
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	DEFAULT_FS_CALL(fsi_read(default_fs, fd, buf, count));
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	DEFAULT_FS_CALL(fsi_pread(default_fs, fd, buf, count, offset));
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	DEFAULT_FS_CALL(fsi_readv(default_fs, fd, iov, iovcnt));
+}
+
+int fs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	DEFAULT_FS_CALL(fsi_preadv(default_fs, fd, iov, iovcnt, offset));
+}
+
+int fs_view_open(int fd, size_t offset, size_t count, struct fs_view *view)
+{
+	DEFAULT_FS_CALL(fsi_view_open(default_fs, fd, offset, count, view));
+}
+
+int fs_fragments(int fd)
+{
+	DEFAULT_FS_CALL(fsi_fragments(default_fs, fd));
+}
+
+int fs_flush(void)
+{
+	DEFAULT_FS_CALL(fsi_flush(default_fs));
+}
+
+int fs_sync(void)
+{
+	DEFAULT_FS_CALL(fsi_sync(default_fs));
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	DEFAULT_FS_CALL(fsi_stats(default_fs, stats));
+}
+
+int fs_aio_submit(struct fs_aio *req)
+{
+	DEFAULT_FS_CALL(fsi_aio_submit(default_fs, req));
+}
+
+int fs_aio_reap(size_t min, size_t max, struct fs_aio **reqs)
+{
+	DEFAULT_FS_CALL(fsi_aio_reap(default_fs, min, max, reqs));
+}
+
+int fs_set_sync_mode(int enable)
+{
+	// applies to the mounted FS right away, and to the next ones
+	pthread_rwlock_wrlock(&default_lock);
+	default_options.sync_mode = enable;
+	if (default_fs)
+		fsi_set_sync_mode(default_fs, enable);
+	pthread_rwlock_unlock(&default_lock);
+	return 0;
+}
+
+int fs_set_readahead(size_t max_blocks)
+{
+	pthread_rwlock_wrlock(&default_lock);
+	default_options.readahead_blocks = max_blocks;
+	if (default_fs)
+		fsi_set_readahead(default_fs, max_blocks);
+	pthread_rwlock_unlock(&default_lock);
+	return 0;
+}
+
+int fs_set_cache_size(size_t nblocks)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs) // takes effect at the next fs_mount
+	{
+		default_options.cache_blocks = nblocks;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_set_mmap(int enable)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs)
+	{
+		default_options.mmap = enable;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_set_delayed_alloc(size_t max_blocks)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs)
+	{
+		default_options.delayed_alloc_blocks = max_blocks;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_set_aio_threads(size_t nthreads)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs)
+	{
+		default_options.aio_threads = nthreads;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_set_sched_window(unsigned int window_us)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs)
+	{
+		default_options.sched_window_us = window_us;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+int fs_set_fat_cache(size_t nblocks)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&default_lock);
+	if (!default_fs)
+	{
+		default_options.fat_cache_blocks = nblocks;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&default_lock);
+	return ret;
+}
+
+/* ==========  HELPER FUNCTIONS  ======================================= */
+int fd_acquire(struct fs* fs, int fd)
+{
+	/* locks FD fd for a reader holding the FS lock shared
+
+	Returns: -1 if no FS is mounted or fd isn't open, 0 otherwise */
+	if (fd >= MAX_FD || fd < 0 || fs->fd_table[fd].is_free)
+		return -1;
+	pthread_mutex_lock(&fs->fd_table[fd].lock);
+	return 0;
+}
+
+int file_locator(struct fs* fs, const char* fname)
+{
+	/* PARAMETRS
+		fname: path of the file or directory to search for 
+
+	   RETURN:
+		the root entry of the file that matches fname,
+		 otherwise returns -1.
+	*/
+	uint32_t parent;
+	const char* name;
+	size_t len;
+	if (path_locator(fs, fname, &parent, &name, &len) == -1)
+		return -1;
+	return entry_locator(fs, parent, name, len);
+}
+
+int path_locator(struct fs* fs, const char* path, uint32_t* parent, const char** name, size_t* len)
+{
+	/* resolves every component of path but the last one, from the root 
+	directory. Components are separated by '/' on version 2, which has
+	directories, a version 1 path is a single filename
+
+	Sets: parent to the directory holding the last component (DIR_ROOT,
+	or 1 + its root entry), name and len to the last component
+	Returns: -1 if path is NULL, if the last component is empty or longer
+	than FS_FILENAME_LEN, or if a directory on the way doesn't exist, 0
+	otherwise */
+	if (!path)
+		return -1;
+	*parent = DIR_ROOT;
+	if (fs->superblock.version != FS_VERSION_1)
+	{
+		const char* slash;
+		if (*path == '/')
+			path++;
+		while ((slash = strchr(path, '/')))
+		{
+			int i = entry_locator(fs, *parent, path, slash - path);
+			if (i == -1 || !fs->root[i].is_dir)
+				return -1;
+			*parent = i + 1;
+			path = slash + 1;
+		}
+	}
+	*name = path;
+	*len = strlen(path);
+	if (*len == 0 || *len > FS_FILENAME_LEN)
+		return -1;
+	return 0;
+}
+
+int entry_locator(struct fs* fs, uint32_t parent, const char* name, size_t len)
+{
+	/* returns the root entry named after the first len characters of
+	name in directory parent, or -1 if there is none. Only the root 
+	entries in the hash bucket of (parent, name) are compared */
+	if (len == 0 || len > FS_FILENAME_LEN)
+		return -1;
+	int32_t i = fs->name_buckets[entry_hash(parent, name, len) & (fs->n_name_buckets - 1)];
+	while (i != -1)
+	{
+		const struct root_t* entry = &fs->root[i];
+		if (entry->parent == parent && !memcmp(entry->filename, name, len)
+		    && (len == FS_FILENAME_LEN || entry->filename[len] == '\0'))
+			return i;
+		i = fs->name_chain[i];
+	}
+	return -1;
+}
+
+uint32_t entry_hash(uint32_t parent, const char* name, size_t len)
+{
+	/* FNV-1a hash of directory parent followed by the first len
+	characters of a filename */
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 4; i++)
+	{
+		hash ^= (uint8_t) (parent >> (8 * i));
+		hash *= 16777619u;
+	}
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+char* entry_path(struct fs* fs, uint32_t file_index)
+{
+	/* returns the path of root entry file_index, in a buffer to be freed,
+	or NULL if memory can't be allocated. Parents are followed at most
+	n_root_entries times, in case a damaged disk made them loop */
+	size_t len = 0, depth = 0;
+	for (uint32_t i = file_index + 1; i != DIR_ROOT && depth <= fs->n_root_entries; i = fs->root[i - 1].parent, depth++)
+		len += strnlen(fs->root[i - 1].filename, FS_FILENAME_LEN) + 1;
+
+	char* path = malloc(len);
+	if (!path)
+		return NULL;
+	// filled from the end, separators go between the names
+	size_t pos = len - 1;
+	path[pos] = '\0';
+	depth = 0;
+	for (uint32_t i = file_index + 1; i != DIR_ROOT && depth <= fs->n_root_entries; i = fs->root[i - 1].parent, depth++)
+	{
+		size_t n = strnlen(fs->root[i - 1].filename, FS_FILENAME_LEN);
+		pos -= n;
+		memcpy(path + pos, fs->root[i - 1].filename, n);
+		if (pos)
+			path[--pos] = '/';
+	}
+	return path;
+}
+
+int name_index_builder(struct fs* fs, uint32_t n_buckets)
+{
+	/* indexes every used root entry by filename, in n_buckets buckets (a
+	power of two), more if needed to keep twice as many buckets as files
+
+	Returns: -1 if memory can't be allocated, in which case the index is
+	left as it was, 0 otherwise */
+	while (n_buckets < 2 * (size_t)fs->n_files)
+		n_buckets *= 2;
+	int32_t* buckets = malloc(n_buckets * sizeof(int32_t));
+	if (!buckets)
+		return -1;
+	free(fs->name_buckets);
+	fs->name_buckets = buckets;
+	fs->n_name_buckets = n_buckets;
+
+	for (uint32_t h = 0; h < n_buckets; h++)
+		fs->name_buckets[h] = -1;
+	for (uint32_t i = 0; i < fs->n_root_entries; i++)
+	{
+		fs->name_chain[i] = -1;
+		if (fs->root[i].filename[0] != '\0')
+			name_index_insert(fs, i);
+	}
+	return 0;
+}
+
+void name_index_insert(struct fs* fs, int file_index)
+{
+	/* adds root entry file_index to the bucket of its directory and filename */
+	const struct root_t* entry = &fs->root[file_index];
+	uint32_t h = entry_hash(entry->parent, entry->filename, strnlen(entry->filename, FS_FILENAME_LEN)) & (fs->n_name_buckets - 1);
+	fs->name_chain[file_index] = fs->name_buckets[h];
+	fs->name_buckets[h] = file_index;
+}
+
+void name_index_remove(struct fs* fs, int file_index)
+{
+	/* unlinks root entry file_index from the bucket of its directory and
+	filename, must be called before they are cleared */
+	const struct root_t* entry = &fs->root[file_index];
+	uint32_t h = entry_hash(entry->parent, entry->filename, strnlen(entry->filename, FS_FILENAME_LEN)) & (fs->n_name_buckets - 1);
+	int32_t* link = &fs->name_buckets[h];
+	while (*link != file_index)
+		link = &fs->name_chain[*link];
+	*link = fs->name_chain[file_index];
+	fs->name_chain[file_index] = -1;
+}
+
+
+uint32_t cursor_locator(struct fs* fs, int fd, struct chain_cursor* cursor, uint32_t blk_num)
+{
+	/* finds the datablock holding logical block blk_num of the file 
+	opened as fd. The FAT chain is walked from the closest known block
+	before blk_num: either cursor or an entry of the file's skip
+	index. Once the index covers the file, any block is reached in less
+	than SKIP_INTERVAL steps
+	PARAMTERS:
+		fd: file descriptor
+		cursor: the FD cursor, or a copy of it
+		blk_num: logical block number within the file (offset / block size)
+
+	Returns:
+	the datablock index (FAT index), or FAT_EOC if the file has no such
+	block. The cursor is left on the last block that was reached
+	*/
+	struct file_descriptor_t* desc = &fs->fd_table[fd];
+	struct open_file_t* file = desc->file;
+	uint32_t n = 0;
+	uint32_t idx = fs->root[desc->file_index].idx_first_blk;
+
+	if (idx == FAT_EOC)
+		return FAT_EOC; // empty file
+	pthread_mutex_lock(&file->lock); // other FDs of the file may walk it too
+	skip_index_note(file, 0, idx);
+
+	if (file->n_skip > 0)
+	{
+		uint32_t k = MIN(blk_num / SKIP_INTERVAL, file->n_skip - 1);
+		n = k * SKIP_INTERVAL;
+		idx = file->skip[k];
+	}
+
+	if (cursor->phys != FAT_EOC && cursor->blk <= blk_num && cursor->blk > n)
+	{
+		n = cursor->blk;
+		idx = cursor->phys;
+	}
+
+	while (n < blk_num && fat_get(fs, idx) != FAT_EOC)
+	{
+		idx = fat_get(fs, idx);
+		n++;
+		skip_index_note(file, n, idx);
+	}
+	pthread_mutex_unlock(&file->lock);
+	cursor->blk = n;
+	cursor->phys = idx;
+	return (n == blk_num) ? idx : FAT_EOC;
+}
+
+struct open_file_t* open_file_locator(struct fs* fs, int file_index)
+{
+	/* returns the shared state of file_index, setting it up if the file 
+	isn't open yet. There are as many slots as FDs, so one is always free */
+	struct open_file_t* free_slot = NULL;
+	for (int i = 0; i < MAX_FD; i++)
+	{
+		if (fs->open_files[i].file_index == file_index)
+		{
+			fs->open_files[i].n_open++;
+			return &fs->open_files[i];
+		}
+		if (fs->open_files[i].file_index == -1 && !free_slot)
+			free_slot = &fs->open_files[i];
+	}
+
+	free_slot->file_index = file_index;
+	free_slot->n_open = 1;
+	free_slot->n_skip = 0;
+	free_slot->tail_blk = FAT_EOC; // found when the file is first extended
+	free_slot->n_alloc_blks = (fs->root[file_index].file_size + fs->superblock.block_size - 1) / fs->superblock.block_size;
+	free_slot->n_pending = 0;
+	return free_slot;
+}
+
+void open_file_release(struct open_file_t* file)
+{
+	/* drops one FD reference, the skip index goes away with the last one */
+	if (--file->n_open > 0)
+		return;
+	free(file->skip);
+	file->skip = NULL;
+	file->n_skip = file->skip_capacity = 0;
+	free(file->pending); // buffered blocks were flushed by fs_close
+	file->pending = NULL;
+	file->pending_capacity = 0;
+	file->file_index = -1;
+}
+
+void skip_index_note(struct open_file_t* file, uint32_t blk_num, uint32_t blk)
+{
+	/* records that logical block blk_num of file is datablock blk, if 
+	it is the next entry of the skip index. The index is only a shortcut,
+	so failing to grow it is not an error */
+	if (blk_num % SKIP_INTERVAL != 0 || blk_num / SKIP_INTERVAL != file->n_skip)
+		return;
+
+	if (file->n_skip == file->skip_capacity)
+	{
+		uint32_t capacity = file->skip_capacity ? 2 * file->skip_capacity : 16;
+		uint32_t* skip = realloc(file->skip, capacity * sizeof(uint32_t));
+		if (!skip)
+			return;
+		file->skip = skip;
+		file->skip_capacity = capacity;
+	}
+	file->skip[file->n_skip++] = blk;
+}
+
+int free_db_entries_locator(struct fs* fs, uint32_t start_blk)
+{
+	/* searches the free-space bitmap for a free datablock entry at or
+	after start_blk, wrapping around to the begining of the disk. The
+	n_delalloc_blks datablocks set aside for buffered blocks by 
+	delalloc_write are not given away
+	
+	Returns:
+	the index of the first free datablock found.
+	if no datablock left in the disk, returns -1
+	   */
+	if (free_blk_counter(fs, fs->n_delalloc_blks) <= fs->n_delalloc_blks)
+		return -1; // no more space left in the disk
+
+	int blk = next_free_blk_locator(fs, start_blk);
+	if (blk == -1)
+		blk = next_free_blk_locator(fs, 0);
+	return blk;
+}
+
+int next_free_blk_locator(struct fs* fs, size_t start_blk)
+{
+	/* returns the first free datablock at or after start_blk, without 
+	wrapping around, or -1. The bitmap is scanned a whole word 
+	(64 datablocks) at a time */
+	if (start_blk >= fs->superblock.n_data_blks)
+		return -1;
+
+	size_t w = start_blk / 64;
+	free_map_scan(fs, start_blk);
+	uint64_t word = fs->free_map[w] & (~(uint64_t)0 << (start_blk % 64));
+	while (!word)
+	{
+		if (++w == fs->free_map_words)
+			return -1;
+		free_map_scan(fs, w * 64);
+		word = fs->free_map[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
+}
+
+size_t free_run_length(struct fs* fs, uint32_t blk, size_t max_blks)
+{
+	/* counts the free datablocks following each other from blk
+	(at most max_blks). Bits past the last datablock are never set,
+	so a run always stops at the end of the disk */
+	size_t n_blks = 0;
+	while (n_blks < max_blks && blk + n_blks < fs->superblock.n_data_blks)
+	{
+		size_t pos = blk + n_blks;
+		free_map_scan(fs, pos);
+		uint64_t used = ~fs->free_map[pos / 64] >> (pos % 64);
+		if (used)
+		{
+			n_blks += __builtin_ctzll(used); // run ends in this word
+			break;
+		}
+		n_blks += 64 - (pos % 64);
+	}
+	return MIN(n_blks, max_blks);
+}
+
+int free_run_locator(struct fs* fs, uint32_t start_blk, size_t n_blks, struct open_file_t* self)
+{
+	/* searches for n_blks free datablocks following each other, 
+	starting at start_blk and wrapping around to the begining of the disk.
+	When self is given, runs overlapping the reservation window of 
+	another open file are skipped
+
+	Returns:
+	the index of the first datablock of the run, -1 if there is none */
+	for (int pass = 0; pass < 2; pass++)
+	{
+		size_t pos = pass ? 0 : start_blk;
+		size_t end = pass ? start_blk : fs->superblock.n_data_blks;
+		while (pos < end)
+		{
+			int blk = next_free_blk_locator(fs, pos);
+			if (blk == -1 || (size_t)blk >= end)
+				break;
+			size_t len = free_run_length(fs, blk, n_blks);
+			if (len < n_blks)
+			{
+				pos = blk + len + 1; // skip the run and the used block ending it
+				continue;
+			}
+			size_t resume = reservation_conflict(fs, self, blk, n_blks);
+			if (!resume)
+				return blk;
+			pos = resume;
+		}
+	}
+	return -1;
+}
+
+size_t reservation_conflict(struct fs* fs, struct open_file_t* self, size_t blk, size_t n_blks)
+{
+	/* checks datablocks blk to blk + n_blks - 1 against the reservation 
+	windows of the open files other than self
+
+	Returns: 0 if there is no overlap, otherwise the datablock right
+	after the window that overlaps */
+	if (!self)
+		return 0;
+
+	for (int i = 0; i < MAX_FD; i++)
+	{
+		struct open_file_t* file = &fs->open_files[i];
+		if (file == self || file->file_index == -1 || file->tail_blk == FAT_EOC)
+			continue;
+		size_t window_start = file->tail_blk + 1;
+		size_t window_end = window_start + RESERVE_WINDOW;
+		if (blk < window_end && window_start < blk + n_blks)
+			return window_end;
+	}
+	return 0;
+}
+
+uint32_t reserve_locator(struct fs* fs, struct open_file_t* file, uint32_t last_blk, size_t n_blks)
+{
+	/* picks where n_blks new datablocks of a file ending at last_blk
+	(FAT_EOC if empty) should go, so the file stays contiguous:
+	right after last_blk when these blocks are free, otherwise the
+	first free run large enough, preferably outside of the reservation
+	windows of other open files. Falls back to last_blk + 1, from
+	where blocks are then taken one at a time
+	
+	Returns: the datablock the allocations should start from */
+	uint32_t goal = (last_blk == FAT_EOC) ? 0 : last_blk + 1;
+	if (last_blk != FAT_EOC && goal < fs->superblock.n_data_blks
+	    && free_run_length(fs, goal, n_blks) == n_blks)
+		return goal;
+
+	int run = free_run_locator(fs, goal, n_blks, file);
+	if (run == -1)
+		run = free_run_locator(fs, goal, n_blks, NULL);
+	if (run != -1)
+		return run;
+	return goal;
+}
+
+int free_map_builder(struct fs* fs)
+{
+	/* builds the free-space bitmap from the FAT entries.
+	Entries marked as 0 correspond to free data blocks
+	
+	Returns: -1 if the bitmap can't be allocated, 0 otherwise */
+	fs->free_map_words = (fs->superblock.n_data_blks + 63) / 64;
+	fs->free_map = calloc(fs->free_map_words, sizeof(uint64_t));
+	if (!fs->free_map)
+		return -1;
+
+	fs->n_free_blks = 0;
+	if (!fs->FAT)
+		return 0; // paged FAT: filled by free_map_scan as allocations go
+	for (uint32_t i = 0; i < fs->superblock.n_data_blks; i++)
+	{
+		if (fs->FAT[i] == 0)
+			free_map_update(fs, i, 1);
+	}
+	return 0;
+}
+
+void free_map_update(struct fs* fs, uint32_t blk, int is_free)
+{
+	/* marks datablock blk as free or used in the free-space bitmap */
+	uint64_t bit = (uint64_t)1 << (blk % 64);
+	if (is_free)
+	{
+		fs->free_map[blk / 64] |= bit;
+		fs->n_free_blks++;
+	}
+	else
+	{
+		fs->free_map[blk / 64] &= ~bit;
+		fs->n_free_blks--;
+	}
+}
+
+void free_map_scan(struct fs* fs, uint32_t blk)
+{
+	/* with a paged FAT, adds the free entries of the FAT block holding
+	the entry of datablock blk to the free-space bitmap, unless it was
+	done already. Datablocks freed since mount already have their bit
+	set. A FAT block that can't be loaded stays out of the bitmap, as if
+	all its datablocks were used */
+	if (!fs->fat_scanned)
+		return;
+	size_t entries_per_blk = fat_entries_per_blk(fs);
+	uint32_t fat_blk = blk / entries_per_blk;
+	if (fs->fat_scanned[fat_blk])
+		return;
+
+	pthread_mutex_lock(&fs->fat_lock);
+	uint32_t* entries = fat_page_locator(fs, fat_blk);
+	if (entries)
+	{
+		size_t first = (size_t)fat_blk * entries_per_blk;
+		size_t end = MIN(first + entries_per_blk, fs->superblock.n_data_blks);
+		for (size_t i = first; i < end; i++)
+		{
+			if (entries[i - first] == 0 && !((fs->free_map[i / 64] >> (i % 64)) & 1))
+				free_map_update(fs, i, 1);
+		}
+		fs->fat_scanned[fat_blk] = 1;
+		fs->n_unscanned_fat_blks--;
+	}
+	pthread_mutex_unlock(&fs->fat_lock);
+}
+
+uint32_t free_blk_counter(struct fs* fs, uint32_t n_wanted)
+{
+	/* returns the number of free datablocks. With a paged FAT, the FAT
+	blocks not scanned yet are scanned until more than n_wanted 
+	datablocks are known to be free, or until the whole FAT was */
+	size_t entries_per_blk = fat_entries_per_blk(fs);
+	for (uint32_t i = 0; i < fs->superblock.n_FAT_blks; i++)
+	{
+		if (!fs->n_unscanned_fat_blks || fs->n_free_blks > n_wanted)
+			break;
+		free_map_scan(fs, i * entries_per_blk);
+	}
+	return fs->n_free_blks;
+}
+
+int block_allocator(struct fs* fs, struct open_file_t* file, uint32_t prev_blk, uint32_t goal_blk)
+{
+	/* appends a free datablock to the chain of a file
+	PARAMETERS:
+		file: open file to extend
+		prev_blk: current last block of the file, FAT_EOC if file is empty
+		goal_blk: preferred datablock, the first free one from there is used
+
+	Returns:
+	the index of the new datablock, or -1 if the disk is full
+	*/
+	int blk = free_db_entries_locator(fs, goal_blk);
+	if (blk == -1)
+		return -1;
+	free_map_update(fs, blk, 0);
+
+	if (prev_blk == FAT_EOC) //empty file has fist_blk as FAT_EOC
+	{
+		fs->root[file->file_index].idx_first_blk = blk;
+		root_entry_dirty(fs, file->file_index);
+	}
+	else
+		fat_set(fs, prev_blk, blk);
+	fat_set(fs, blk, FAT_EOC);
+	file->tail_blk = blk;
+	file->n_alloc_blks++;
+	return blk;
+}
+
+size_t contiguous_run_locator(struct fs* fs, uint32_t first_blk, size_t max_blks)
+{
+	/* counts how many blocks of a chain, starting at first_blk, 
+	follow each other on disk (at most max_blks). Such a run can be
+	transfered with a single disk request */
+	size_t n_blks = 1;
+	while (n_blks < max_blks && fat_get(fs, first_blk) == first_blk + 1)
+	{
+		first_blk++;
+		n_blks++;
+	}
+	return n_blks;
+}
+
+void readahead(struct fs* fs, int fd, uint32_t first_blk, uint64_t end, const struct chain_cursor* cursor)
+{
+	/* called once a read of the file opened as fd, which started in 
+	logical block first_blk, stopped at file offset end with cursor on
+	the last block read. When the read started where the previous one
+	stopped, the blocks that follow are loaded into the block cache before
+	they are needed. Each time the reader catches up with the blocks read 
+	ahead, the window doubles, up to readahead_max_blks */
+	struct file_descriptor_t* desc = &fs->fd_table[fd];
+	uint32_t next = (end + fs->superblock.block_size - 1) / fs->superblock.block_size; // first block not read at all
+	size_t max_window = MIN(fs->readahead_max_blks, fs->cache_size / 2);
+
+	if (first_blk != desc->ra_next_blk || max_window == 0)
+	{
+		// random access, start over
+		desc->ra_window = 0;
+		desc->ra_end_blk = 0;
+		desc->ra_next_blk = end / fs->superblock.block_size;
+		return;
+	}
+	desc->ra_next_blk = end / fs->superblock.block_size;
+
+	// reads of more than a window are already done with large requests
+	if (next - first_blk >= max_window || next < desc->ra_end_blk)
+		return;
+
+	desc->ra_window = desc->ra_window ? MIN(2 * desc->ra_window, max_window) : MIN(READAHEAD_MIN, max_window);
+	desc->ra_end_blk = next + desc->ra_window;
+
+	// blocks buffered by delayed allocation leave the cursor behind: nothing follows them
+	uint32_t next_blk = FAT_EOC;
+	if (cursor->phys != FAT_EOC && cursor->blk == (end - 1) / fs->superblock.block_size)
+		next_blk = fat_get(fs, cursor->phys);
+	for (size_t n_blks = desc->ra_window; n_blks > 0 && next_blk != FAT_EOC; )
+	{
+		size_t n_run = contiguous_run_locator(fs, next_blk, n_blks);
+		if (cache_prefetch(fs->cache, next_blk + fs->superblock.data_blk_start_index, n_run) == -1)
+			return;
+		n_blks -= n_run;
+		next_blk = fat_get(fs, next_blk + n_run - 1);
+	}
+}
+
+uint32_t tail_locator(struct fs* fs, struct open_file_t* file)
+{
+	/* returns the last datablock of the chain of file (FAT_EOC if it 
+	has none), walking the chain from the last skip index entry if 
+	it isn't known yet */
+	if (file->tail_blk != FAT_EOC)
+		return file->tail_blk;
+
+	uint32_t n = 0;
+	uint32_t idx = fs->root[file->file_index].idx_first_blk;
+	if (idx == FAT_EOC)
+		return FAT_EOC;
+	skip_index_note(file, 0, idx);
+	if (file->n_skip > 0)
+	{
+		n = (file->n_skip - 1) * SKIP_INTERVAL;
+		idx = file->skip[file->n_skip - 1];
+	}
+	while (fat_get(fs, idx) != FAT_EOC)
+	{
+		idx = fat_get(fs, idx);
+		n++;
+		skip_index_note(file, n, idx);
+	}
+	file->tail_blk = idx;
+	return idx;
+}
+
+int delalloc_write(struct fs* fs, struct open_file_t* file, uint32_t blk_num, size_t offset_from_blk, size_t len, const void* buf)
+{
+	/* copies len bytes into buffered block blk_num of file, which is 
+	past the end of its chain. Files only grow contiguously, so a new 
+	buffered block is always the next one
+
+	Returns: -1 if the disk has no room left for a new block once every
+	buffered block is given a datablock (or if memory runs out), 0 otherwise */
+	uint32_t i = blk_num - file->n_alloc_blks;
+	if (i == file->n_pending)
+	{
+		if (fs->n_delalloc_blks >= free_blk_counter(fs, fs->n_delalloc_blks))
+			return -1;
+		if (file->n_pending == file->pending_capacity)
+		{
+			uint32_t capacity = file->pending_capacity ? 2 * file->pending_capacity : 16;
+			uint8_t** pending = realloc(file->pending, capacity * sizeof(uint8_t*));
+			if (!pending)
+				return -1;
+			file->pending = pending;
+			file->pending_capacity = capacity;
+		}
+		// what the writes don't cover reaches the disk as zeros
+		file->pending[i] = calloc(1, fs->superblock.block_size);
+		if (!file->pending[i])
+			return -1;
+		file->n_pending++;
+		fs->n_delalloc_blks++;
+	}
+	memcpy(file->pending[i] + offset_from_blk, buf, len);
+	return 0;
+}
+
+void delalloc_read(struct open_file_t* file, uint32_t blk_num, size_t offset_from_blk, size_t len, void* buf)
+{
+	/* copies len bytes out of buffered block blk_num of file */
+	memcpy(buf, file->pending[blk_num - file->n_alloc_blks] + offset_from_blk, len);
+}
+
+int delalloc_flush(struct fs* fs, struct open_file_t* file)
+{
+	/* gives datablocks to the buffered blocks of file, now that their
+	number is known: they are appended to the chain as one contiguous 
+	run whenever possible, and written FLUSH_RUN_MAX blocks at a time.
+	Room for them was set aside by delalloc_write. Should a datablock be
+	missing anyway, the buffered blocks from there on are dropped and the
+	file is cut where its chain ends
+
+	Returns: -1 if writing to disk fails or if a buffered block was 
+	dropped, 0 otherwise */
+	if (file->n_pending == 0)
+		return 0;
+
+	struct iovec iov[FLUSH_RUN_MAX];
+	int n_iov = 0;
+	int ret = 0;
+	uint32_t run_start = 0;
+	uint32_t prev_blk = tail_locator(fs, file);
+	uint32_t goal = reserve_locator(fs, file, prev_blk, file->n_pending);
+	// the datablocks set aside for the buffered blocks are taken now
+	fs->n_delalloc_blks -= file->n_pending;
+
+	for (uint32_t i = 0; i < file->n_pending; i++)
+	{
+		int blk = block_allocator(fs, file, prev_blk, goal);
+		if (blk == -1)
+		{
+			ret = -1;
+			break;
+		}
+		if (n_iov > 0 && ((uint32_t)blk != prev_blk + 1 || n_iov == FLUSH_RUN_MAX))
+		{
+			// run is over, write it
+			if (cache_writev(fs->cache, run_start + fs->superblock.data_blk_start_index, iov, n_iov) == -1)
+				ret = -1;
+			n_iov = 0;
+		}
+		if (n_iov == 0)
+			run_start = blk;
+		iov[n_iov].iov_base = file->pending[i];
+		iov[n_iov].iov_len = fs->superblock.block_size;
+		n_iov++;
+		prev_blk = blk;
+		goal = blk + 1;
+	}
+	if (n_iov > 0 && cache_writev(fs->cache, run_start + fs->superblock.data_blk_start_index, iov, n_iov) == -1)
+		ret = -1;
+
+	// blocks that didn't get a datablock are lost
+	uint64_t chain_size = (uint64_t)file->n_alloc_blks * fs->superblock.block_size;
+	if (fs->root[file->file_index].file_size > chain_size)
+	{
+		fs->root[file->file_index].file_size = chain_size;
+		root_entry_dirty(fs, file->file_index);
+	}
+	for (uint32_t i = 0; i < file->n_pending; i++)
+		free(file->pending[i]);
+	file->n_pending = 0;
+	return ret;
+}
+
+int delalloc_flush_all(struct fs* fs)
+{
+	/* flushes the buffered blocks of every open file */
+	int ret = 0;
+	for (int i = 0; i < MAX_FD; i++)
+	{
+		if (fs->open_files[i].file_index != -1 && delalloc_flush(fs, &fs->open_files[i]) == -1)
+			ret = -1;
+	}
+	return ret;
+}
+
+uint32_t fat_get(struct fs* fs, uint32_t idx)
+{
+	/* returns FAT entry idx, loading its FAT block first when the FAT is
+	paged. An entry of a FAT block that can't be loaded reads as the end
+	of the chain */
+	if (fs->FAT)
+		return fs->FAT[idx];
+
+	size_t entries_per_blk = fat_entries_per_blk(fs);
+	pthread_mutex_lock(&fs->fat_lock);
+	uint32_t* entries = fat_page_locator(fs, idx / entries_per_blk);
+	uint32_t value = entries ? entries[idx % entries_per_blk] : FAT_EOC;
+	pthread_mutex_unlock(&fs->fat_lock);
+	return value;
+}
+
+void fat_set(struct fs* fs, uint32_t idx, uint32_t value)
+{
+	/* updates FAT entry idx, and remembers that its FAT block must be 
+	written back */
+	size_t entries_per_blk = fat_entries_per_blk(fs);
+	if (fs->FAT)
+	{
+		fs->FAT[idx] = value;
+		fs->fat_dirty[idx / entries_per_blk] = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&fs->fat_lock);
+	uint32_t* entries = fat_page_locator(fs, idx / entries_per_blk);
+	if (entries)
+	{
+		entries[idx % entries_per_blk] = value;
+		fs->fat_dirty[idx / entries_per_blk] = 1;
+	}
+	else
+	{
+		// kept until the block is loaded, at the latest by fs_sync
+		if (fs->n_fat_pending == fs->fat_pending_capacity)
+		{
+			size_t capacity = fs->fat_pending_capacity ? 2 * fs->fat_pending_capacity : 16;
+			struct fat_update_t* pending = realloc(fs->fat_pending, capacity * sizeof(struct fat_update_t));
+			if (!pending)
+			{
+				fs->fat_error = 1; // the update is lost, fs_sync will tell
+				pthread_mutex_unlock(&fs->fat_lock);
+				return;
+			}
+			fs->fat_pending = pending;
+			fs->fat_pending_capacity = capacity;
+		}
+		fs->fat_pending[fs->n_fat_pending].idx = idx;
+		fs->fat_pending[fs->n_fat_pending].value = value;
+		fs->n_fat_pending++;
+		fs->fat_dirty[idx / entries_per_blk] = 1;
+	}
+	pthread_mutex_unlock(&fs->fat_lock);
+}
+
+uint32_t* fat_page_locator(struct fs* fs, uint32_t fat_blk)
+{
+	/* returns the entries of FAT block fat_blk in a paged FAT, loading 
+	the block in the least recently used page if it isn't in memory.
+	A dirty page is written back, after the cached data, before being
+	reused. Must be called with fat_lock held
+
+	The updates made while the block couldn't be loaded are applied to 
+	it, in order.
+
+	Returns: NULL if the block can't be read, or if the page to reuse
+	can't be written back, otherwise the entries of the block */
+	uint32_t page_idx = fs->fat_page_index[fat_blk];
+	if (page_idx)
+	{
+		fs->fat_pages[page_idx - 1].last_use = ++fs->fat_clock;
+		return fs->fat_pages[page_idx - 1].entries;
+	}
+
+	// unused pages were never accessed, so they are picked first
+	struct fat_page_t* page = &fs->fat_pages[0];
+	for (size_t i = 1; i < fs->fat_max_blks; i++)
+	{
+		if (fs->fat_pages[i].last_use < page->last_use)
+			page = &fs->fat_pages[i];
+	}
+	if (page->fat_blk != FAT_EOC)
+	{
+		// write to fat_blk+1, since the first blk is superblock. Data
+		// first, as in fs_sync, so that the chains of the page never
+		// point to blocks not written yet
+		if (fs->fat_dirty[page->fat_blk])
+		{
+			if (cache_flush(fs->cache) == -1 ||
+			    disk_write(fs->disk, page->fat_blk + 1,
+				       fat_block_encode(fs, page->entries, fs->meta_buf)) == -1)
+				return NULL;
+			fs->fat_dirty[page->fat_blk] = 0;
+		}
+		fs->fat_page_index[page->fat_blk] = 0;
+		page->fat_blk = FAT_EOC;
+		page->last_use = 0;
+		fs->fat_evictions++;
+	}
+
+	if (disk_read(fs->disk, fat_blk + 1, page->entries) == -1)
+		return NULL;
+	size_t entries_per_blk = fat_entries_per_blk(fs);
+	fat_widen(fs, page->entries, entries_per_blk);
+	size_t n_kept = 0;
+	for (size_t i = 0; i < fs->n_fat_pending; i++)
+	{
+		struct fat_update_t update = fs->fat_pending[i];
+		if (update.idx / entries_per_blk == fat_blk)
+			page->entries[update.idx % entries_per_blk] = update.value;
+		else
+			fs->fat_pending[n_kept++] = update;
+	}
+	fs->n_fat_pending = n_kept;
+	page->fat_blk = fat_blk;
+	page->last_use = ++fs->fat_clock;
+	fs->fat_page_index[fat_blk] = page - fs->fat_pages + 1;
+	fs->fat_loads++;
+	return page->entries;
+}
+
+int fat_pager_builder(struct fs* fs)
+{
+	/* sets up fs->fat_max_blks unused pages for a paged FAT, and the
+	FAT blocks as not scanned into the free-space bitmap yet
+
+	Returns: -1 if memory can't be allocated, 0 otherwise */
+	uint32_t n_FAT_blks = fs->superblock.n_FAT_blks;
+	fs->fat_max_blks = MIN(fs->fat_max_blks, n_FAT_blks);
+	fs->fat_pages = calloc(fs->fat_max_blks, sizeof(struct fat_page_t));
+	fs->fat_page_index = calloc(n_FAT_blks, sizeof(uint32_t));
+	fs->fat_scanned = calloc(n_FAT_blks, sizeof(uint8_t));
+	if (!fs->fat_pages || !fs->fat_page_index || !fs->fat_scanned)
+	{
+		fat_pager_release(fs);
+		return -1;
+	}
+
+	for (size_t i = 0; i < fs->fat_max_blks; i++)
+	{
+		fs->fat_pages[i].fat_blk = FAT_EOC;
+		fs->fat_pages[i].entries = malloc(fat_entries_per_blk(fs) * sizeof(uint32_t));
+		if (!fs->fat_pages[i].entries)
+		{
+			fat_pager_release(fs);
+			return -1;
+		}
+	}
+	fs->n_unscanned_fat_blks = n_FAT_blks;
+	return 0;
+}
+
+void fat_pager_release(struct fs* fs)
+{
+	/* frees the pages of a paged FAT, whether it is dirty or not */
+	if (fs->fat_pages)
+	{
+		for (size_t i = 0; i < fs->fat_max_blks; i++)
+			free(fs->fat_pages[i].entries);
+	}
+	free(fs->fat_pages);
+	free(fs->fat_page_index);
+	free(fs->fat_scanned);
+	free(fs->fat_pending);
+	fs->fat_pages = NULL;
+	fs->fat_page_index = NULL;
+	fs->fat_scanned = NULL;
+	fs->fat_pending = NULL;
+	fs->n_fat_pending = 0;
+	fs->fat_pending_capacity = 0;
+}
+
+void root_entry_dirty(struct fs* fs, int file_index)
+{
+	/* remembers that root entry file_index must be written back */
+	fs->root_dirty[file_index / 64] |= (uint64_t)1 << (file_index % 64);
+}
+
+int metadata_writeback(struct fs* fs)
+{
+	/* writes the FAT blocks and the root directory blocks that changed
+	since they were last written
+
+	Returns: -1 if writing a block fails, or if an update of a paged
+	FAT was lost, 0 otherwise. A block that fails stays dirty and the 
+	others are still written */
+	int ret = fs->fat_error ? -1 : 0;
+
+	for (uint32_t i = 0; i < fs->superblock.n_FAT_blks; i++)
+	{
+		if (!fs->fat_dirty[i])
+			continue;
+		const uint32_t* entries;
+		if (fs->FAT)
+			entries = fs->FAT + (size_t)i * fat_entries_per_blk(fs);
+		else
+		{
+			// dirty pages are only reused once written back, so the
+			// block is in memory, and stays there while the FS is
+			// locked exclusively. Unless it couldn't be loaded: it is
+			// loaded now, with its pending updates
+			pthread_mutex_lock(&fs->fat_lock);
+			entries = fat_page_locator(fs, i);
+			pthread_mutex_unlock(&fs->fat_lock);
+		}
+		// write to i+1, since the first blk is superblock
+		if (!entries || disk_write(fs->disk, i+1, fat_block_encode(fs, entries, fs->meta_buf)) == -1)
+		{
+			ret = -1;
+			continue;
+		}
+		fs->fat_dirty[i] = 0;
+	}
+
+	// only write the directory blocks holding an entry that changed,
+	// once each. The datablocks a directory grew into are linked in the
+	// FAT, written above, before the superblock points to them
+	size_t n_words = (fs->n_root_entries + 63) / 64;
+	for (size_t w = 0; w < n_words; w++)
+	{
+		uint64_t todo = fs->root_dirty[w]; // entries of this word not tried yet
+		while (todo)
+		{
+			uint32_t first, n_entries;
+			uint32_t i = w * 64 + __builtin_ctzll(todo);
+			uint32_t blk = dir_blk_locator(fs, i, &first, &n_entries);
+			root_encode(fs, first, n_entries, fs->meta_buf);
+			int written = disk_write(fs->disk, blk, fs->meta_buf) != -1;
+			if (!written)
+				ret = -1;
+			for (uint32_t k = first; k < first + n_entries; k++)
+			{
+				if (k / 64 == w)
+					todo &= ~((uint64_t)1 << (k % 64));
+				if (written)
+					fs->root_dirty[k / 64] &= ~((uint64_t)1 << (k % 64));
+			}
+		}
+	}
+
+	if (fs->sb_dirty)
+	{
+		memset(fs->meta_buf, 0, MAX(fs->superblock.block_size, SUPER_BLOCK_SIZE));
+		superblock_encode(&fs->superblock, fs->meta_buf);
+		if (disk_write(fs->disk, 0, fs->meta_buf) == -1)
+			ret = -1;
+		else
+			fs->sb_dirty = 0;
+	}
+	return ret;
+}
+
+size_t fat_entry_size(struct fs* fs)
+{
+	/* returns the size of a FAT entry on disk */
+	return fs->superblock.version == FS_VERSION_1 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+size_t fat_entries_per_blk(struct fs* fs)
+{
+	/* returns how many FAT entries a FAT block holds */
+	return fs->superblock.block_size / fat_entry_size(fs);
+}
+
+void fat_widen(struct fs* fs, uint32_t* entries, size_t n_entries)
+{
+	/* turns the n_entries FAT entries read at the start of entries into
+	32-bit entries. Version 1 entries are widened in place, from the last
+	one, so that every entry is read before being overwritten */
+	if (fs->superblock.version != FS_VERSION_1)
+		return;
+
+	for (size_t i = n_entries; i-- > 0; )
+	{
+		uint16_t entry;
+		memcpy(&entry, (uint8_t*)entries + i * sizeof(uint16_t), sizeof(entry));
+		entries[i] = (entry == FAT_EOC_V1) ? FAT_EOC : entry;
+	}
+}
+
+const void* fat_block_encode(struct fs* fs, const uint32_t* entries, uint8_t* buf)
+{
+	/* returns the FAT block made of entries as it is stored on disk:
+	right where the entries are for version 2, narrowed into buf for
+	version 1 */
+	if (fs->superblock.version != FS_VERSION_1)
+		return entries;
+
+	for (size_t i = 0; i < fat_entries_per_blk(fs); i++)
+	{
+		uint16_t entry = (entries[i] == FAT_EOC) ? FAT_EOC_V1 : entries[i];
+		memcpy(buf + i * sizeof(uint16_t), &entry, sizeof(entry));
+	}
+	return buf;
+}
+
+int superblock_decode(struct fs* fs, const void* blk)
+{
+	/* fills fs->superblock from the superblock read from disk, in either
+	format
+	
+	Returns: -1 if the signature or the block size is unknown, or if the
+	FAT can't hold an entry for every datablock or the layout doesn't fit
+	in the disk, 0 otherwise */
+	struct superblock_t* sb = &fs->superblock;
+	if (!strncmp(blk, SIG_V1, SIG_LEN))
+	{
+		const struct superblock_v1_t* v1 = blk;
+		sb->version = FS_VERSION_1;
+		sb->n_blks = v1->n_blks;
+		sb->root_dir_index = v1->root_dir_index;
+		sb->data_blk_start_index = v1->data_blk_start_index;
+		sb->n_data_blks = v1->n_data_blks;
+		sb->n_FAT_blks = v1->n_FAT_blks;
+		sb->block_size = DEFAULT_BLOCK_SIZE;
+		sb->root_ext_blk = 0;
+	}
+	else if (!strncmp(blk, SIG_V2, SIG_LEN))
+	{
+		const struct superblock_v2_t* v2 = blk;
+		sb->version = FS_VERSION_2;
+		sb->n_blks = v2->n_blks;
+		sb->root_dir_index = v2->root_dir_index;
+		sb->data_blk_start_index = v2->data_blk_start_index;
+		sb->n_data_blks = v2->n_data_blks;
+		sb->n_FAT_blks = v2->n_FAT_blks;
+		sb->block_size = v2->block_size ? v2->block_size : DEFAULT_BLOCK_SIZE;
+		sb->root_ext_blk = v2->root_ext_blk;
+		if (sb->n_blks > MAX_BLKS_V2 || sb->block_size < FS_BLOCK_SIZE_MIN
+		    || sb->block_size > FS_BLOCK_SIZE_MAX
+		    || (sb->block_size & (sb->block_size - 1)))
+			return -1;
+	}
+	else
+		return -1;
+
+	size_t entries_per_blk = sb->block_size / fat_entry_size(fs);
+	if (sb->n_data_blks > (size_t)sb->n_FAT_blks * entries_per_blk
+	    || sb->n_FAT_blks >= sb->n_blks
+	    || (size_t)sb->root_dir_index + root_blk_count(sb) > sb->n_blks
+	    || sb->data_blk_start_index > sb->n_blks
+	    || sb->n_data_blks > sb->n_blks - sb->data_blk_start_index
+	    || (sb->root_ext_blk && sb->root_ext_blk >= sb->n_data_blks))
+		return -1;
+	return 0;
+}
+
+void superblock_encode(const struct superblock_t* sb, void* blk)
+{
+	/* fills the first SUPER_BLOCK_SIZE bytes of blk with superblock sb, as
+	stored on disk */
+	memset(blk, 0, SUPER_BLOCK_SIZE);
+	if (sb->version == FS_VERSION_1)
+	{
+		struct superblock_v1_t* v1 = blk;
+		memcpy(v1->signature, SIG_V1, SIG_LEN);
+		v1->n_blks = sb->n_blks;
+		v1->root_dir_index = sb->root_dir_index;
+		v1->data_blk_start_index = sb->data_blk_start_index;
+		v1->n_data_blks = sb->n_data_blks;
+		v1->n_FAT_blks = sb->n_FAT_blks;
+	}
+	else
+	{
+		struct superblock_v2_t* v2 = blk;
+		memcpy(v2->signature, SIG_V2, SIG_LEN);
+		v2->n_blks = sb->n_blks;
+		v2->root_dir_index = sb->root_dir_index;
+		v2->data_blk_start_index = sb->data_blk_start_index;
+		v2->n_data_blks = sb->n_data_blks;
+		v2->n_FAT_blks = sb->n_FAT_blks;
+		v2->block_size = sb->block_size;
+		v2->root_ext_blk = sb->root_ext_blk;
+	}
+}
+
+uint32_t root_blk_count(const struct superblock_t* sb)
+{
+	/* returns how many blocks the root directory spans */
+	return (ROOT_SIZE + sb->block_size - 1) / sb->block_size;
+}
+
+void root_decode(struct fs* fs, uint32_t first, uint32_t n_entries, const uint8_t* blk)
+{
+	/* fills the n_entries root entries from first on with the directory 
+	block(s) read from disk, which start with them */
+	for (uint32_t i = 0; i < n_entries; i++)
+	{
+		struct root_t* entry = &fs->root[first + i];
+		if (fs->superblock.version == FS_VERSION_1)
+		{
+			struct root_v1_t v1;
+			memcpy(&v1, blk + i * sizeof(v1), sizeof(v1));
+			memcpy(entry->filename, v1.filename, FS_FILENAME_LEN);
+			entry->file_size = v1.file_size;
+			entry->idx_first_blk = (v1.idx_first_blk == FAT_EOC_V1) ? FAT_EOC : v1.idx_first_blk;
+			entry->parent = DIR_ROOT;
+			entry->is_dir = 0;
+		}
+		else
+		{
+			struct root_v2_t v2;
+			memcpy(&v2, blk + i * sizeof(v2), sizeof(v2));
+			memcpy(entry->filename, v2.filename, FS_FILENAME_LEN);
+			entry->file_size = v2.file_size;
+			entry->idx_first_blk = v2.idx_first_blk;
+			entry->parent = v2.parent & ~DIR_FLAG;
+			entry->is_dir = (v2.parent & DIR_FLAG) != 0;
+		}
+		entry->n_children = 0;
+	}
+}
+
+void root_encode(struct fs* fs, uint32_t first, uint32_t n_entries, uint8_t* blk)
+{
+	/* fills blk with the n_entries root entries from first on, as stored
+	on disk. The rest of the block is padded with zeros */
+	memset(blk, 0, MAX(fs->superblock.block_size, ROOT_SIZE));
+	for (uint32_t i = 0; i < n_entries; i++)
+	{
+		const struct root_t* entry = &fs->root[first + i];
+		if (fs->superblock.version == FS_VERSION_1)
+		{
+			struct root_v1_t v1 = { .file_size = entry->file_size };
+			memcpy(v1.filename, entry->filename, FS_FILENAME_LEN);
+			v1.idx_first_blk = (entry->idx_first_blk == FAT_EOC) ? FAT_EOC_V1 : entry->idx_first_blk;
+			memcpy(blk + i * sizeof(v1), &v1, sizeof(v1));
+		}
+		else
+		{
+			struct root_v2_t v2 = { .file_size = entry->file_size, .idx_first_blk = entry->idx_first_blk,
+						.parent = entry->parent | (entry->is_dir ? DIR_FLAG : 0) };
+			memcpy(v2.filename, entry->filename, FS_FILENAME_LEN);
+			memcpy(blk + i * sizeof(v2), &v2, sizeof(v2));
+		}
+	}
+}
+
+uint32_t dir_blk_locator(struct fs* fs, uint32_t file_index, uint32_t* first, uint32_t* n_entries)
+{
+	/* returns the disk block holding root entry file_index, and sets first
+	and n_entries to the root entries stored in that block */
+	uint32_t entries_per_blk = fs->superblock.block_size / ROOT_ENTRY_SIZE;
+	if (file_index < FS_FILE_MAX_COUNT)
+	{
+		// the root directory blocks, or a part of the only one
+		*n_entries = MIN(entries_per_blk, FS_FILE_MAX_COUNT);
+		*first = file_index - file_index % *n_entries;
+		return fs->superblock.root_dir_index + file_index / *n_entries;
+	}
+	uint32_t k = (file_index - FS_FILE_MAX_COUNT) / entries_per_blk;
+	*first = FS_FILE_MAX_COUNT + k * entries_per_blk;
+	*n_entries = entries_per_blk;
+	return fs->superblock.data_blk_start_index + fs->dir_blks[k];
+}
+
+int dir_loader(struct fs* fs)
+{
+	/* sets up the root entries: those of the root directory blocks, which
+	fs_mount left in fs->meta_buf, then for version 2 those of the 
+	datablocks chained from superblock.root_ext_blk, read one at a time 
+	into fs->meta_buf
+
+	Returns: -1 if memory can't be allocated, if the chain is broken or
+	if one of its blocks can't be read, or if an entry belongs to a
+	directory that doesn't exist, 0 otherwise */
+	uint32_t entries_per_blk = fs->superblock.block_size / ROOT_ENTRY_SIZE;
+	if (dir_capacity_reserve(fs, FS_FILE_MAX_COUNT) == -1)
+	{
+		dir_release(fs);
+		return -1;
+	}
+	root_decode(fs, 0, FS_FILE_MAX_COUNT, fs->meta_buf);
+	fs->n_root_entries = FS_FILE_MAX_COUNT;
+
+	uint32_t blk = fs->superblock.root_ext_blk ? fs->superblock.root_ext_blk : FAT_EOC;
+	while (blk != FAT_EOC)
+	{
+		// a chain longer than the disk loops
+		if (blk == 0 || blk >= fs->superblock.n_data_blks
+		    || fs->n_dir_blks == fs->superblock.n_data_blks
+		    || fs->n_root_entries > INT32_MAX - entries_per_blk
+		    || dir_capacity_reserve(fs, fs->n_root_entries + entries_per_blk) == -1
+		    || dir_blk_append(fs, blk) == -1
+		    || disk_read(fs->disk, fs->superblock.data_blk_start_index + blk, fs->meta_buf) == -1)
+		{
+			dir_release(fs);
+			return -1;
+		}
+		root_decode(fs, fs->n_root_entries, entries_per_blk, fs->meta_buf);
+		fs->n_root_entries += entries_per_blk;
+		blk = fat_get(fs, blk);
+	}
+
+	fs->n_files = 0;
+	fs->root_free_hint = fs->n_root_entries;
+	for (uint32_t i = fs->n_root_entries; i-- > 0; )
+	{
+		const struct root_t* entry = &fs->root[i];
+		if (entry->filename[0] == '\0')
+		{
+			fs->root_free_hint = i;
+			continue;
+		}
+		fs->n_files++;
+		if (entry->parent == DIR_ROOT)
+			continue;
+		// the directory of an entry must be one
+		if (entry->parent > fs->n_root_entries
+		    || fs->root[entry->parent - 1].filename[0] == '\0'
+		    || !fs->root[entry->parent - 1].is_dir)
+		{
+			dir_release(fs);
+			return -1;
+		}
+		fs->root[entry->parent - 1].n_children++;
+	}
+	return 0;
+}
+
+int dir_grow(struct fs* fs)
+{
+	/* appends a datablock of empty entries to a version 2 root directory, 
+	at the end of the chain starting at superblock.root_ext_blk. The
+	block is written from the root entries by the next metadata_writeback
+
+	Returns: -1 if no datablock is left besides those promised to 
+	delayed allocation, or if memory can't be allocated, 0 otherwise */
+	uint32_t entries_per_blk = fs->superblock.block_size / ROOT_ENTRY_SIZE;
+	if (fs->n_root_entries > INT32_MAX - entries_per_blk)
+		return -1; // root entries are numbered with an int32_t
+	if (free_blk_counter(fs, fs->n_delalloc_blks) <= fs->n_delalloc_blks)
+		return -1;
+	uint32_t n_entries = fs->n_root_entries + entries_per_blk;
+	if (dir_capacity_reserve(fs, n_entries) == -1)
+		return -1;
+
+	// next to the previous block of the directory when there is room
+	uint32_t last = fs->n_dir_blks ? fs->dir_blks[fs->n_dir_blks - 1] : FAT_EOC;
+	int blk = free_db_entries_locator(fs, last == FAT_EOC ? 0 : last + 1);
+	if (blk == -1 || dir_blk_append(fs, blk) == -1)
+		return -1;
+	free_map_update(fs, blk, 0);
+	fat_set(fs, blk, FAT_EOC);
+	if (last == FAT_EOC)
+	{
+		fs->superblock.root_ext_blk = blk;
+		fs->sb_dirty = 1;
+	}
+	else
+		fat_set(fs, last, blk);
+	// directory blocks don't go through the block cache
+	cache_invalidate(fs->cache, blk + fs->superblock.data_blk_start_index);
+
+	for (uint32_t i = fs->n_root_entries; i < n_entries; i++)
+		root_entry_dirty(fs, i);
+	fs->n_root_entries = n_entries;
+	return 0;
+}
+
+int dir_blk_append(struct fs* fs, uint32_t blk)
+{
+	/* adds datablock blk at the end of fs->dir_blks, whose memory is
+	doubled whenever its length reaches a power of two
+
+	Returns: -1 if memory can't be allocated, 0 otherwise */
+	uint32_t n = fs->n_dir_blks;
+	if ((n & (n - 1)) == 0)
+	{
+		uint32_t* dir_blks = realloc(fs->dir_blks, MAX(2 * (size_t)n, 1) * sizeof(uint32_t));
+		if (!dir_blks)
+			return -1;
+		fs->dir_blks = dir_blks;
+	}
+	fs->dir_blks[fs->n_dir_blks++] = blk;
+	return 0;
+}
+
+int dir_capacity_reserve(struct fs* fs, uint32_t n_entries)
+{
+	/* makes room in memory for n_entries root entries, at least doubling
+	the capacity when it grows. The entries added are empty, clean and in
+	no hash chain
+
+	Returns: -1 if memory can't be allocated, 0 otherwise */
+	if (n_entries <= fs->root_capacity)
+		return 0;
+	size_t capacity = MAX(n_entries, 2 * (size_t)fs->root_capacity);
+	capacity = MIN(capacity, (size_t)INT32_MAX);
+	size_t n_words = (fs->root_capacity + 63) / 64;
+	size_t new_n_words = (capacity + 63) / 64;
+
+	struct root_t* root = realloc(fs->root, capacity * sizeof(struct root_t));
+	if (!root)
+		return -1;
+	fs->root = root;
+	int32_t* name_chain = realloc(fs->name_chain, capacity * sizeof(int32_t));
+	if (!name_chain)
+		return -1;
+	fs->name_chain = name_chain;
+	uint64_t* root_dirty = realloc(fs->root_dirty, new_n_words * sizeof(uint64_t));
+	if (!root_dirty)
+		return -1;
+	fs->root_dirty = root_dirty;
+
+	for (size_t i = fs->root_capacity; i < capacity; i++)
+	{
+		memset(&fs->root[i], 0, sizeof(struct root_t));
+		fs->root[i].idx_first_blk = FAT_EOC;
+		fs->name_chain[i] = -1;
+	}
+	memset(fs->root_dirty + n_words, 0, (new_n_words - n_words) * sizeof(uint64_t));
+	fs->root_capacity = capacity;
+	return 0;
+}
+
+void dir_release(struct fs* fs)
+{
+	/* frees the root entries and everything indexing them */
+	free(fs->root);
+	free(fs->root_dirty);
+	free(fs->name_chain);
+	free(fs->name_buckets);
+	free(fs->dir_blks);
+	fs->root = NULL;
+	fs->root_dirty = NULL;
+	fs->name_chain = NULL;
+	fs->name_buckets = NULL;
+	fs->dir_blks = NULL;
+	fs->root_capacity = 0;
+	fs->n_root_entries = 0;
+	fs->n_dir_blks = 0;
+}
+
+ssize_t iov_length(const struct iovec* iov, int iovcnt)
+{
+	/* returns the total length of the buffers of iov, or -1 if iov is
+	invalid (NULL, or holding a NULL buffer that isn't empty) */
+	size_t len = 0;
+	if (iovcnt < 0 || (iovcnt > 0 && !iov))
+		return -1;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		if (!iov[i].iov_base && iov[i].iov_len)
+			return -1;
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+size_t iov_contig(struct iov_cursor* cur)
+{
+	/* returns how many bytes are left in the current buffer, moving to
+	the next non-empty buffer first if it is used up */
+	while (cur->iovcnt > 0 && cur->pos == cur->iov->iov_len)
+	{
+		cur->iov++;
+		cur->iovcnt--;
+		cur->pos = 0;
+	}
+	return cur->iovcnt > 0 ? cur->iov->iov_len - cur->pos : 0;
+}
+
+uint8_t* iov_base(struct iov_cursor* cur)
+{
+	/* returns the address of the next byte to transfer */
+	iov_contig(cur);
+	return (uint8_t*)cur->iov->iov_base + cur->pos;
+}
+
+const void* iov_gather(struct iov_cursor* cur, size_t len, uint8_t* bounce_buf)
+{
+	/* consumes the next len bytes of the buffers. Returns where they can
+	be read from: right in the current buffer if they all are there, in 
+	bounce_buf otherwise, where they are copied */
+	if (iov_contig(cur) >= len)
+	{
+		const void* data = iov_base(cur);
+		cur->pos += len;
+		return data;
+	}
+	for (size_t done = 0; done < len; )
+	{
+		size_t n = MIN(len - done, iov_contig(cur));
+		memcpy(bounce_buf + done, iov_base(cur), n);
+		cur->pos += n;
+		done += n;
+	}
+	return bounce_buf;
+}
+
+void iov_scatter(struct iov_cursor* cur, size_t len, const uint8_t* data)
+{
+	/* consumes the next len bytes of the buffers, which hold a copy of
+	data unless data already points to them */
+	if (data == iov_base(cur))
+	{
+		cur->pos += len; // read in place, len doesn't exceed iov_contig
+		return;
+	}
+	for (size_t done = 0; done < len; )
+	{
+		size_t n = MIN(len - done, iov_contig(cur));
+		memcpy(iov_base(cur), data + done, n);
+		cur->pos += n;
+		done += n;
 	}
-	return -1; // no more space left in the disk
 }
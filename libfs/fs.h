@@ -2,23 +2,183 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in the root directory of %FS_VERSION_1 volumes.
+ * The root directory of %FS_VERSION_2 volumes grows past it, into data
+ * blocks, as files are created */
 #define FS_FILE_MAX_COUNT 128
 
+/** On-disk format of ECS150FS images: 16-bit block indices and 32-bit file
+ * sizes, volumes of up to 65535 blocks */
+#define FS_VERSION_1 1
+
+/** On-disk format with 32-bit block indices and 64-bit file sizes */
+#define FS_VERSION_2 2
+
+/** Smallest and largest block sizes of %FS_VERSION_2 volumes, in bytes.
+ * %FS_VERSION_1 volumes always have 4096-byte blocks */
+#define FS_BLOCK_SIZE_MIN 512
+#define FS_BLOCK_SIZE_MAX (1024 * 1024)
+
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Mounted file system, see fsi_mount() (opaque) */
+struct fs;
+
+/** Settings a file system is mounted with, see fsi_mount() */
+struct fs_options {
+	/* Blocks held by the block cache, see fs_set_cache_size() */
+	size_t cache_blocks;
+	/* Non-zero to memory-map the virtual disk file, see fs_set_mmap() */
+	int mmap;
+	/* Blocks buffered by delayed allocation, see fs_set_delayed_alloc() */
+	size_t delayed_alloc_blocks;
+	/* Non-zero for synchronous metadata updates, see fs_set_sync_mode() */
+	int sync_mode;
+	/* Largest readahead window, see fs_set_readahead() */
+	size_t readahead_blocks;
+	/* Threads running asynchronous requests, see fs_set_aio_threads() */
+	size_t aio_threads;
+	/* Batching window of disk requests, see fs_set_sched_window() */
+	unsigned int sched_window_us;
+	/* FAT blocks kept in memory, see fs_set_fat_cache() */
+	size_t fat_cache_blocks;
+};
+
+/** Settings a virtual disk is formatted with, see fs_format() */
+struct fs_format_options {
+	/* On-disk format, %FS_VERSION_1 or %FS_VERSION_2 */
+	int version;
+	/* Size of a block in bytes, a power of two */
+	size_t block_size;
+};
+
+/** Counters describing the activity of the mounted file system */
+struct fs_stats {
+	/* Data block accesses served by the block cache */
+	uint64_t cache_hits;
+	/* Data block accesses that had to read the disk */
+	uint64_t cache_misses;
+	/* Cached blocks dropped to make room for other blocks */
+	uint64_t cache_evictions;
+	/* Dirty cached blocks written back to disk */
+	uint64_t cache_writebacks;
+	/* Data blocks loaded into the cache by sequential readahead */
+	uint64_t readahead_blocks;
+	/* Time it took fs_mount() to load the file system, in nanoseconds */
+	uint64_t mount_time_ns;
+	/* Disk requests batched by the request scheduler */
+	uint64_t disk_requests;
+	/* Disk transfers these requests were merged into */
+	uint64_t disk_transfers;
+	/* FAT blocks loaded on demand, see fs_set_fat_cache() */
+	uint64_t fat_loads;
+	/* Loaded FAT blocks dropped to make room for other FAT blocks */
+	uint64_t fat_evictions;
+};
+
+/** Read-only view of a file range, see fs_view_open() */
+struct fs_view {
+	/* Private to the file system */
+	struct fs *fs;
+	int fd;
+	size_t offset;
+	size_t end;
+	uint32_t blk;
+};
+
+/** Piece of a file range returned by fs_view_next() */
+struct fs_span {
+	/* Content of the file, never longer than a block */
+	const void *data;
+	size_t len;
+	/* Private to the file system */
+	const void *block;
+	int source;
+	struct fs *fs;
+};
+
+/** Operations of an asynchronous request */
+enum fs_aio_op {
+	/** Same as fs_pread() */
+	FS_AIO_READ,
+	/** Same as fs_pwrite() */
+	FS_AIO_WRITE,
+};
+
+/** Asynchronous request, see fs_aio_submit() */
+struct fs_aio {
+	/* Request, set by the caller. @buf must stay valid until completion */
+	enum fs_aio_op op;
+	int fd;
+	void *buf;
+	size_t count;
+	size_t offset;
+	/* Called on an I/O thread once the request is done. When NULL, the
+	 * request is returned by fs_aio_reap() instead */
+	void (*callback)(struct fs_aio *req);
+	/* Left untouched, for the caller's own use */
+	void *data;
+	/* Return value of fs_pread() or fs_pwrite(), set on completion */
+	int result;
+	/* Private to the file system */
+	struct fs *fs;
+};
+
+/**
+ * fs_format - Create a virtual disk file holding an empty file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks of the file system
+ * @opts: Format settings, or NULL for the defaults (see fs_format_init())
+ *
+ * Create virtual disk file @diskname, replacing any file of that name, sized
+ * for @data_blocks data blocks plus the superblock, the FAT and the root
+ * directory, and write an empty file system to it.
+ *
+ * With %FS_VERSION_1 (the default), the file system is an ECS150FS image, as
+ * made by fs_make.x, which limits it to 65535 blocks (256 MiB) and files to
+ * 4 GiB. %FS_VERSION_2 uses 32-bit FAT entries and 64-bit file sizes, for up
+ * to 2^31 - 1 blocks (8 TiB with the default block size). fs_mount() detects
+ * the format on its own.
+ *
+ * Blocks are 4096 bytes long by default. %FS_VERSION_2 volumes can use any
+ * power of two between %FS_BLOCK_SIZE_MIN and %FS_BLOCK_SIZE_MAX instead, which
+ * is recorded in the superblock: small blocks waste less space on small files,
+ * large blocks make for a smaller FAT and longer disk transfers. Everything
+ * counted in blocks, such as the cache size, is counted in blocks of the
+ * mounted volume.
+ *
+ * Return: -1 if @data_blocks is 0 or too large for the format, if the format
+ * is unknown, if the block size is not valid for the format, or if the
+ * virtual disk file cannot be created or written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks,
+	      const struct fs_format_options *opts);
+
+/**
+ * fs_format_init - Get the default format settings
+ * @opts: Settings to be filled
+ */
+void fs_format_init(struct fs_format_options *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). Both on-disk formats (see
+ * fs_format()) are recognized by their superblock signature.
+ *
+ * The functions that take no file system handle work on the file system
+ * mounted by fs_mount(), so only one can be mounted that way at a time. Use
+ * fsi_mount() to mount more.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
@@ -54,29 +214,61 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * On a %FS_VERSION_2 file system, @filename is a path: names separated by
+ * '/', each one following the rule above, with an optional leading '/'. The
+ * names before the last one are directories created with fs_mkdir(), and the
+ * file is created in the last of them. Paths are resolved in memory, one hash
+ * lookup per name, without reading the disk. fs_open() and fs_delete() take
+ * paths as well.
+ *
+ * On a %FS_VERSION_2 file system, a full root directory takes a free data
+ * block for the entries of new files. Data blocks taken this way stay in the
+ * directory when its files are deleted.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if a directory of path @filename doesn't exist, or if the root directory
+ * already contains %FS_FILE_MAX_COUNT files on a %FS_VERSION_1 file system,
+ * or if there is no free data block left for it on a %FS_VERSION_2 file
+ * system. 0 otherwise.
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @path: Path of the directory
+ *
+ * Create a new and empty directory at @path, like fs_create() creates a
+ * file. Directories share the root entries with files: each one takes an
+ * entry, and so does each file or directory it contains. A directory is
+ * removed with fs_delete() once it is empty, and cannot be opened.
+ *
+ * Return: -1 if no FS is currently mounted, or if the file system is a
+ * %FS_VERSION_1 one, which has no directories, or for the same reasons as
+ * fs_create(). 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. On a %FS_VERSION_2 file system, @filename is a path (see
+ * fs_create()), which can name an empty directory.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * there is no file named @filename to delete, or if file @filename is
+ * currently open, or if directory @filename isn't empty. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files located in the root directory. Files
+ * located in directories are listed with their path, and directories with a
+ * line of their own.
  *
  * Return: -1 if no FS is currently mounted. 0 otherwise.
  */
@@ -94,10 +286,12 @@ int fs_ls(void);
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
  * simultaneously.
  *
+ * On a %FS_VERSION_2 file system, @filename is a path (see fs_create()).
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if @filename is a directory,
+ * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
+ * return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -119,11 +313,23 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * invalid (out of bounds or not currently open), or if the size does not fit
+ * in an int (see fs_stat64()). Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat64 - Get the size of a file of any size
+ * @fd: File descriptor
+ * @size: Filled with the current size of the file
+ *
+ * Same as fs_stat(), for files larger than 2 GiB.
+ *
+ * Return: -1 if no FS is currently mounted, if file descriptor @fd is invalid
+ * or if @size is NULL. 0 otherwise.
+ */
+int fs_stat64(int fd, uint64_t *size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -182,4 +388,486 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), except that data is written at @offset, and that the
+ * file offset of file descriptor @fd is neither used nor changed. This lets
+ * several users share a file descriptor without seeking it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), except that data is read from @offset, and that the file
+ * offset of file descriptor @fd is neither used nor changed. Threads sharing
+ * @fd read in parallel, they don't wait for each other.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read (0 if @offset is at or past the end
+ * of the file).
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Data buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), with the data gathered from the @iovcnt buffers of @iov.
+ * The whole write is a single pass over the file, and blocks covered by
+ * several buffers are assembled before being written, so that they are not
+ * read first.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or one of its
+ * buffers is NULL. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwritev - Write to a file from several buffers at a given offset
+ * @fd: File descriptor
+ * @iov: Data buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ * @offset: File offset to write at
+ *
+ * Combination of fs_writev() and fs_pwrite().
+ *
+ * Return: Same as fs_pwrite().
+ */
+int fs_pwritev(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Data buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), with the data scattered to the @iovcnt buffers of @iov,
+ * in a single pass over the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or one of its
+ * buffers is NULL. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_preadv - Read from a file into several buffers at a given offset
+ * @fd: File descriptor
+ * @iov: Data buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ * @offset: File offset to read from
+ *
+ * Combination of fs_readv() and fs_pread().
+ *
+ * Return: Same as fs_pread().
+ */
+int fs_preadv(int fd, const struct iovec *iov, int iovcnt, size_t offset);
+
+/**
+ * fs_view_open - Start reading a file range without copying it
+ * @fd: File descriptor
+ * @offset: File offset of the range
+ * @count: Length of the range
+ * @view: View to be set up
+ *
+ * Set up @view to go through @count bytes of the file referenced by file
+ * descriptor @fd, starting at @offset, with fs_view_next(). The range is
+ * reduced to the end of the file. The file offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @offset is larger than
+ * the current file size, or if @view is NULL. 0 otherwise.
+ */
+int fs_view_open(int fd, size_t offset, size_t count, struct fs_view *view);
+
+/**
+ * fs_view_next - Get the next piece of a file range
+ * @view: View set up by fs_view_open()
+ * @span: Span to be filled
+ *
+ * Point @span to the next part of the range of @view, which ends at the end of
+ * a block at the latest. When the block is held by the block cache or by the
+ * memory mapping of the virtual disk (see fs_set_mmap()), @span->data points
+ * right into it and nothing is copied. Otherwise the block is copied to a
+ * buffer owned by @span. Either way, @span->data is read-only and stays valid
+ * until fs_span_release(), which must be called before file descriptor @fd is
+ * closed. Data written to the file after the call may or may not show through
+ * @span->data.
+ *
+ * Return: -1 if the block cannot be read. 0 if the end of the range was
+ * reached. 1 if @span was filled.
+ */
+int fs_view_next(struct fs_view *view, struct fs_span *span);
+
+/**
+ * fs_span_release - Release a span
+ * @span: Span filled by fs_view_next()
+ */
+void fs_span_release(struct fs_span *span);
+
+/**
+ * fs_fragments - Count the fragments of a file
+ * @fd: File descriptor
+ *
+ * Count how many runs of physically contiguous blocks the file pointed by file
+ * descriptor @fd is made of. A file whose blocks all follow each other on disk
+ * has a single fragment.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the number
+ * of fragments of the file (0 for an empty file).
+ */
+int fs_fragments(int fd);
+
+/**
+ * fs_set_cache_size - Configure the data block cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Set the size of the write-back block cache used for file data. The new size
+ * takes effect at the next fs_mount(). A size of 0 disables caching, so that
+ * every read and write goes straight to the virtual disk.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_cache_size(size_t nblocks);
+
+/**
+ * fs_flush - Write back cached file data
+ *
+ * Write every dirty block held by the block cache to the virtual disk. Dirty
+ * blocks are otherwise only written when they get evicted or when the file
+ * system is unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if writing a block fails. 0
+ * otherwise.
+ */
+int fs_flush(void);
+
+/**
+ * fs_sync - Write back all pending changes
+ *
+ * Write cached file data (see fs_flush()), then the parts of the FAT and of
+ * the root directory that changed since they were last written. File system
+ * metadata is otherwise only written by fs_umount(), or right away by
+ * fs_create() and fs_delete() in synchronous mode.
+ *
+ * Return: -1 if no FS is currently mounted, or if writing a block fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_set_sync_mode - Configure synchronous metadata updates
+ * @enable: Non-zero to enable synchronous mode
+ *
+ * In synchronous mode, fs_create() and fs_delete() write the changed metadata
+ * blocks to disk before returning. Otherwise (the default) these changes stay
+ * in memory until fs_sync() or fs_umount(). The mode can be changed at any
+ * time.
+ *
+ * Return: 0.
+ */
+int fs_set_sync_mode(int enable);
+
+/**
+ * fs_set_readahead - Configure sequential readahead
+ * @max_blocks: Largest number of blocks read ahead at once
+ *
+ * When a file descriptor is read sequentially, the blocks that follow are
+ * loaded into the block cache with a single request before they are needed.
+ * The number of blocks read ahead starts small and doubles while the pattern
+ * holds, up to @max_blocks (64 at most, which is the default) and to half the
+ * cache size. A value of 0 disables readahead. The setting can be changed at
+ * any time.
+ *
+ * Return: 0.
+ */
+int fs_set_readahead(size_t max_blocks);
+
+/**
+ * fs_set_mmap - Select how the virtual disk file is accessed
+ * @enable: Non-zero to memory-map the virtual disk file
+ *
+ * Select the disk backend used by the next fs_mount(). By default, blocks are
+ * read and written with system calls on a file descriptor. When memory mapping
+ * is enabled, the whole virtual disk file is mapped in memory, block accesses
+ * become memory copies, and fs_flush(), fs_sync() and fs_umount() write the
+ * modified pages back to the file. Since the mapping already keeps blocks in
+ * memory, the block cache can be made smaller (see fs_set_cache_size()).
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_mmap(int enable);
+
+/**
+ * fs_set_delayed_alloc - Configure delayed allocation
+ * @max_blocks: Number of blocks that can be buffered before being allocated
+ *
+ * Enable delayed allocation for the next fs_mount(). Data written past the end
+ * of a file is then buffered in memory, and data blocks are only allocated
+ * when the file is closed, on fs_flush() or fs_umount(), or when more than
+ * @max_blocks blocks are buffered overall. Knowing how many blocks a file
+ * needs lets them be allocated as a single contiguous run. A value of 0 (the
+ * default) allocates blocks as soon as they are written.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_delayed_alloc(size_t max_blocks);
+
+/**
+ * fs_set_aio_threads - Configure asynchronous requests
+ * @nthreads: Number of I/O threads
+ *
+ * Set how many I/O threads of the next fs_mount() run asynchronous requests
+ * (see fs_aio_submit()), which is how many of them can wait for the disk at
+ * the same time. The default is 4. A value of 0 disables asynchronous
+ * requests.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_aio_threads(size_t nthreads);
+
+/**
+ * fs_set_sched_window - Configure disk request batching
+ * @window_us: Batching window, in microseconds
+ *
+ * Set the batching window of the next fs_mount(). With a non-zero window,
+ * block requests reaching the virtual disk are held for up to @window_us (or
+ * until 64 of them are pending), then sorted by block number and dispatched,
+ * with requests for adjacent blocks merged into single multi-block transfers.
+ * This reduces seeks and system calls when many requests are in flight (see
+ * fs_aio_submit()) on slow or rotational storage, at the cost of up to
+ * @window_us of added latency per request. The default of 0 dispatches every
+ * request right away. fs_stats() tells how many transfers requests were merged
+ * into.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_sched_window(unsigned int window_us);
+
+/**
+ * fs_set_fat_cache - Configure FAT paging
+ * @nblocks: Number of FAT blocks kept in memory
+ *
+ * By default (@nblocks of 0), fs_mount() reads the whole FAT in memory, which
+ * takes time and memory in proportion to the size of the volume. With a
+ * non-zero @nblocks, the next fs_mount() reads no FAT block at all: they are
+ * loaded when one of their entries is needed, and once @nblocks of them are in
+ * memory, the least recently used one is dropped to make room, after being
+ * written back if it was modified. Free blocks are then discovered as
+ * allocations go, so that fs_info() reads the whole FAT to count them.
+ *
+ * This suits short-lived tools working on a few files of a huge volume.
+ * fs_stats() tells how many FAT blocks were loaded and dropped.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_set_fat_cache(size_t nblocks);
+
+/**
+ * fs_stats - Get file system statistics
+ * @stats: Structure to be filled with the counters
+ *
+ * Get the counters accumulated since the file system was mounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_aio_submit - Start an asynchronous read or write
+ * @req: Request to start
+ *
+ * Queue @req and return without waiting for it. The request is performed by
+ * one of the I/O threads of the file system (see fs_set_aio_threads()), exactly
+ * like fs_pread() or fs_pwrite() would, so that a single caller can keep many
+ * requests in flight and have their disk transfers overlap. Requests run in
+ * parallel, so the order in which requests on the same file range complete is
+ * not defined. Reads run in parallel even when they share a file descriptor,
+ * so a file opened once can be read at several places at once. Writes are
+ * performed one at a time.
+ *
+ * Once the request is done, @req->result is set and @req->callback is called,
+ * or if there is none, @req is queued for fs_aio_reap(). @req must not be
+ * changed meanwhile. The I/O threads are started by the first submission.
+ *
+ * fs_umount() waits for the requests in flight. Callbacks must not unmount
+ * the file system.
+ *
+ * Return: -1 if no FS is currently mounted, if @req is NULL, or if the request
+ * cannot be queued. 0 otherwise.
+ */
+int fs_aio_submit(struct fs_aio *req);
+
+/**
+ * fs_aio_reap - Get completed asynchronous requests
+ * @min: Number of completed requests to wait for
+ * @max: Largest number of completed requests to return
+ * @reqs: Array of @max entries to be filled
+ *
+ * Take up to @max completed requests without a callback, in the order they
+ * completed, waiting until at least @min of them are done. The wait stops
+ * early when no request is left in flight. With @min set to 0, completions
+ * are polled without waiting.
+ *
+ * Return: -1 if no FS is currently mounted, or if @reqs is NULL. Otherwise the
+ * number of entries of @reqs that were filled.
+ */
+int fs_aio_reap(size_t min, size_t max, struct fs_aio **reqs);
+
+/*
+ * Handle-based interface
+ *
+ * fsi_mount() mounts a file system and returns a handle to it, which is then
+ * passed to every call. Any number of virtual disk files can be mounted that
+ * way at the same time, each with its own block cache, settings, locks and
+ * file descriptors (which are only valid with the handle they were opened on).
+ * The functions above are wrappers around these ones, for the file system
+ * mounted by fs_mount().
+ */
+
+/**
+ * fs_options_init - Get the default mount settings
+ * @opts: Settings to be filled
+ *
+ * Fill @opts with the settings fs_mount() uses when no fs_set_*() function
+ * was called.
+ */
+void fs_options_init(struct fs_options *opts);
+
+/**
+ * fsi_mount - Mount a file system and get a handle to it
+ * @diskname: Name of the virtual disk file
+ * @opts: Settings to mount with, or NULL for the defaults
+ *
+ * Same as fs_mount(), with the settings of @opts instead of the ones of the
+ * fs_set_*() functions. The file system is independent from the one mounted
+ * by fs_mount() and from the other ones mounted by fsi_mount(), but the same
+ * virtual disk file must not be mounted twice.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise the handle of the file system.
+ */
+struct fs *fsi_mount(const char *diskname, const struct fs_options *opts);
+
+/**
+ * fsi_umount - Unmount a file system and release its handle
+ * @fs: Mounted file system
+ *
+ * Same as fs_umount(). @fs cannot be used anymore afterwards, even when the
+ * call fails.
+ *
+ * Return: -1 if writing back pending changes fails. 0 otherwise.
+ */
+int fsi_umount(struct fs *fs);
+
+/** fsi_info - Same as fs_info(), on @fs */
+int fsi_info(struct fs *fs);
+
+/** fsi_create - Same as fs_create(), on @fs */
+int fsi_create(struct fs *fs, const char *filename);
+
+/** fsi_mkdir - Same as fs_mkdir(), on @fs */
+int fsi_mkdir(struct fs *fs, const char *path);
+
+/** fsi_delete - Same as fs_delete(), on @fs */
+int fsi_delete(struct fs *fs, const char *filename);
+
+/** fsi_ls - Same as fs_ls(), on @fs */
+int fsi_ls(struct fs *fs);
+
+/** fsi_open - Same as fs_open(), on @fs */
+int fsi_open(struct fs *fs, const char *filename);
+
+/** fsi_close - Same as fs_close(), on @fs */
+int fsi_close(struct fs *fs, int fd);
+
+/** fsi_stat - Same as fs_stat(), on @fs */
+int fsi_stat(struct fs *fs, int fd);
+
+/** fsi_stat64 - Same as fs_stat64(), on @fs */
+int fsi_stat64(struct fs *fs, int fd, uint64_t *size);
+
+/** fsi_lseek - Same as fs_lseek(), on @fs */
+int fsi_lseek(struct fs *fs, int fd, size_t offset);
+
+/** fsi_write - Same as fs_write(), on @fs */
+int fsi_write(struct fs *fs, int fd, void *buf, size_t count);
+
+/** fsi_read - Same as fs_read(), on @fs */
+int fsi_read(struct fs *fs, int fd, void *buf, size_t count);
+
+/** fsi_pwrite - Same as fs_pwrite(), on @fs */
+int fsi_pwrite(struct fs *fs, int fd, const void *buf, size_t count,
+	       size_t offset);
+
+/** fsi_pread - Same as fs_pread(), on @fs */
+int fsi_pread(struct fs *fs, int fd, void *buf, size_t count, size_t offset);
+
+/** fsi_writev - Same as fs_writev(), on @fs */
+int fsi_writev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt);
+
+/** fsi_pwritev - Same as fs_pwritev(), on @fs */
+int fsi_pwritev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt,
+		size_t offset);
+
+/** fsi_readv - Same as fs_readv(), on @fs */
+int fsi_readv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt);
+
+/** fsi_preadv - Same as fs_preadv(), on @fs */
+int fsi_preadv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt,
+	       size_t offset);
+
+/**
+ * fsi_view_open - Same as fs_view_open(), on @fs
+ *
+ * The view is then used with fs_view_next() and fs_span_release(), which
+ * remember the file system the view was opened on.
+ */
+int fsi_view_open(struct fs *fs, int fd, size_t offset, size_t count,
+		  struct fs_view *view);
+
+/** fsi_fragments - Same as fs_fragments(), on @fs */
+int fsi_fragments(struct fs *fs, int fd);
+
+/** fsi_flush - Same as fs_flush(), on @fs */
+int fsi_flush(struct fs *fs);
+
+/** fsi_sync - Same as fs_sync(), on @fs */
+int fsi_sync(struct fs *fs);
+
+/** fsi_set_sync_mode - Same as fs_set_sync_mode(), on @fs */
+int fsi_set_sync_mode(struct fs *fs, int enable);
+
+/** fsi_set_readahead - Same as fs_set_readahead(), on @fs */
+int fsi_set_readahead(struct fs *fs, size_t max_blocks);
+
+/** fsi_stats - Same as fs_stats(), on @fs */
+int fsi_stats(struct fs *fs, struct fs_stats *stats);
+
+/** fsi_aio_submit - Same as fs_aio_submit(), on @fs */
+int fsi_aio_submit(struct fs *fs, struct fs_aio *req);
+
+/** fsi_aio_reap - Same as fs_aio_reap(), on @fs */
+int fsi_aio_reap(struct fs *fs, size_t min, size_t max, struct fs_aio **reqs);
+
 #endif /* _FS_H */
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "iosched.h"
+
+/* Pending block request */
+struct iosched_req {
+	int write;
+	size_t block;
+	size_t count;
+	const struct iovec *iov;
+	int iovcnt;
+	/* Submission order, breaks ties when sorting */
+	uint64_t seq;
+	/* Set once the request was dispatched, with the result in ret */
+	int done;
+	int ret;
+	/* Next pending request, in submission order */
+	struct iosched_req *next;
+};
+
+/* Scheduler instance description */
+struct iosched {
+	iosched_xfer_fn xfer;
+	void *ctx;
+	unsigned int window_us;
+	/* Requests waiting for a batch */
+	struct iosched_req *head, *tail;
+	size_t npending;
+	/* A thread is collecting or dispatching a batch */
+	int collecting;
+	uint64_t seq;
+	struct iosched_stats stats;
+	/* Protects everything above */
+	pthread_mutex_t lock;
+	/* Signaled when the pending requests fill a batch */
+	pthread_cond_t full;
+	/* Signaled when a batch was dispatched */
+	pthread_cond_t done;
+};
+
+/* Whether @a and @b must be performed in submission order */
+static int conflicts(const struct iosched_req *a, const struct iosched_req *b)
+{
+	return (a->write || b->write) &&
+		a->block < b->block + b->count &&
+		b->block < a->block + a->count;
+}
+
+static int req_cmp(const void *pa, const void *pb)
+{
+	const struct iosched_req *a = *(struct iosched_req * const *)pa;
+	const struct iosched_req *b = *(struct iosched_req * const *)pb;
+
+	if (a->block != b->block)
+		return a->block < b->block ? -1 : 1;
+	return a->seq < b->seq ? -1 : 1;
+}
+
+/*
+ * Perform the @n requests of @reqs, sorted by block, merging requests of the
+ * same direction that cover adjacent blocks. Returns the number of transfers.
+ */
+static uint64_t dispatch_sorted(struct iosched *sched, struct iosched_req **reqs,
+				int n)
+{
+	uint64_t transfers = 0;
+	int i = 0;
+
+	while (i < n) {
+		struct iovec *iov = NULL;
+		int iovcnt = reqs[i]->iovcnt;
+		int j = i + 1;
+		int ret;
+
+		while (j < n && reqs[j]->write == reqs[i]->write &&
+		       reqs[j]->block == reqs[j - 1]->block + reqs[j - 1]->count)
+			iovcnt += reqs[j++]->iovcnt;
+
+		if (j - i > 1)
+			iov = malloc(iovcnt * sizeof(*iov));
+		if (iov) {
+			int k = 0;
+
+			for (int r = i; r < j; r++) {
+				memcpy(iov + k, reqs[r]->iov,
+				       reqs[r]->iovcnt * sizeof(*iov));
+				k += reqs[r]->iovcnt;
+			}
+			ret = sched->xfer(sched->ctx, reqs[i]->write,
+					  reqs[i]->block, iov, iovcnt);
+			free(iov);
+		} else {
+			/* Single request, or no memory to merge */
+			j = i + 1;
+			ret = sched->xfer(sched->ctx, reqs[i]->write,
+					  reqs[i]->block, reqs[i]->iov,
+					  reqs[i]->iovcnt);
+		}
+
+		for (; i < j; i++)
+			reqs[i]->ret = ret;
+		transfers++;
+	}
+
+	return transfers;
+}
+
+/*
+ * Perform the @n requests of @reqs, in submission order. The batch is cut
+ * before each request conflicting with an earlier request of its part, and
+ * each part is sorted and merged on its own.
+ */
+static uint64_t dispatch(struct iosched *sched, struct iosched_req **reqs, int n)
+{
+	uint64_t transfers = 0;
+	int start = 0;
+
+	for (int k = 1; k <= n; k++) {
+		int cut = (k == n);
+
+		for (int r = start; r < k && !cut; r++)
+			cut = conflicts(reqs[r], reqs[k]);
+		if (!cut)
+			continue;
+
+		qsort(reqs + start, k - start, sizeof(*reqs), req_cmp);
+		transfers += dispatch_sorted(sched, reqs + start, k - start);
+		start = k;
+	}
+
+	return transfers;
+}
+
+/*
+ * Wait for the batching window, then dispatch up to IOSCHED_BATCH_MAX pending
+ * requests. Called and returns with the scheduler lock held.
+ */
+static void collect(struct iosched *sched)
+{
+	struct iosched_req *batch[IOSCHED_BATCH_MAX];
+	struct timespec deadline;
+	uint64_t transfers;
+	int n = 0;
+
+	sched->collecting = 1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += (long)sched->window_us * 1000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	while (sched->npending < IOSCHED_BATCH_MAX &&
+	       pthread_cond_timedwait(&sched->full, &sched->lock,
+				      &deadline) != ETIMEDOUT)
+		;
+
+	while (n < IOSCHED_BATCH_MAX && sched->head) {
+		batch[n++] = sched->head;
+		sched->head = sched->head->next;
+		sched->npending--;
+	}
+	if (!sched->head)
+		sched->tail = NULL;
+	sched->stats.batches++;
+
+	/* New requests queue up for the next batch meanwhile */
+	pthread_mutex_unlock(&sched->lock);
+	transfers = dispatch(sched, batch, n);
+	pthread_mutex_lock(&sched->lock);
+
+	sched->stats.transfers += transfers;
+	for (int i = 0; i < n; i++)
+		batch[i]->done = 1;
+	sched->collecting = 0;
+	pthread_cond_broadcast(&sched->done);
+}
+
+struct iosched *iosched_open(iosched_xfer_fn xfer, void *ctx, unsigned int window_us)
+{
+	struct iosched *sched = calloc(1, sizeof(*sched));
+
+	if (!sched)
+		return NULL;
+
+	sched->xfer = xfer;
+	sched->ctx = ctx;
+	sched->window_us = window_us;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->full, NULL);
+	pthread_cond_init(&sched->done, NULL);
+
+	return sched;
+}
+
+void iosched_close(struct iosched *sched)
+{
+	if (!sched)
+		return;
+
+	pthread_mutex_destroy(&sched->lock);
+	pthread_cond_destroy(&sched->full);
+	pthread_cond_destroy(&sched->done);
+	free(sched);
+}
+
+int iosched_submit(struct iosched *sched, int write, size_t block, size_t count,
+		 const struct iovec *iov, int iovcnt)
+{
+	struct iosched_req req = {
+		.write = write,
+		.block = block,
+		.count = count,
+		.iov = iov,
+		.iovcnt = iovcnt,
+	};
+
+	pthread_mutex_lock(&sched->lock);
+	req.seq = sched->seq++;
+	if (sched->tail)
+		sched->tail->next = &req;
+	else
+		sched->head = &req;
+	sched->tail = &req;
+	sched->stats.requests++;
+	if (++sched->npending >= IOSCHED_BATCH_MAX)
+		pthread_cond_signal(&sched->full);
+
+	/* Whoever finds no batch being collected collects the next one */
+	while (!req.done) {
+		if (!sched->collecting)
+			collect(sched);
+		else
+			pthread_cond_wait(&sched->done, &sched->lock);
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return req.ret;
+}
+
+void iosched_get_stats(struct iosched *sched, struct iosched_stats *stats)
+{
+	pthread_mutex_lock(&sched->lock);
+	*stats = sched->stats;
+	pthread_mutex_unlock(&sched->lock);
+}
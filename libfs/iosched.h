@@ -0,0 +1,88 @@
+#ifndef _IOSCHED_H
+#define _IOSCHED_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec definition */
+
+/** Largest number of requests dispatched as one batch */
+#define IOSCHED_BATCH_MAX 64
+
+/**
+ * iosched_xfer_fn - Transfer consecutive blocks
+ * @ctx: Context given to iosched_open()
+ * @write: Non-zero to write the blocks, zero to read them
+ * @block: Index of the first block
+ * @iov: Data buffers, their total length covers whole blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Return: -1 if the transfer fails. 0 otherwise.
+ */
+typedef int (*iosched_xfer_fn)(void *ctx, int write, size_t block,
+			     const struct iovec *iov, int iovcnt);
+
+/* Block request scheduler counters */
+struct iosched_stats {
+	/* Requests submitted */
+	uint64_t requests;
+	/* Transfers they were dispatched as, after merging */
+	uint64_t transfers;
+	/* Batches dispatched */
+	uint64_t batches;
+};
+
+/** Block request scheduler (opaque) */
+struct iosched;
+
+/**
+ * iosched_open - Set up a block request scheduler
+ * @xfer: Function performing the transfers
+ * @ctx: First argument of @xfer
+ * @window_us: Batching window, in microseconds
+ *
+ * Requests submitted with iosched_submit() are held for up to @window_us, or
+ * until %IOSCHED_BATCH_MAX of them are pending, then dispatched as a batch:
+ * sorted by block number, and with requests of the same direction covering
+ * adjacent blocks merged into a single call to @xfer. Requests conflicting
+ * with an earlier request of the batch (overlapping blocks, one of them being
+ * a write) are dispatched after it, so that the outcome is the same as in
+ * submission order.
+ *
+ * No thread is started: the first thread that submits a request while no
+ * batch is being collected waits for the window and dispatches the batch.
+ *
+ * Return: NULL if the scheduler cannot be allocated. Otherwise the new
+ * scheduler.
+ */
+struct iosched *iosched_open(iosched_xfer_fn xfer, void *ctx, unsigned int window_us);
+
+/**
+ * iosched_close - Release a block request scheduler
+ * @sched: Scheduler with no request pending
+ */
+void iosched_close(struct iosched *sched);
+
+/**
+ * iosched_submit - Transfer blocks through the scheduler
+ * @sched: Scheduler set up by iosched_open()
+ * @write: Non-zero to write the blocks, zero to read them
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @iov: Data buffers, their total length is @count blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Queue the request and wait until the batch holding it is dispatched.
+ *
+ * Return: -1 if the transfer holding the request fails. 0 otherwise.
+ */
+int iosched_submit(struct iosched *sched, int write, size_t block, size_t count,
+		 const struct iovec *iov, int iovcnt);
+
+/**
+ * iosched_get_stats - Get scheduler counters
+ * @sched: Scheduler set up by iosched_open()
+ * @stats: Structure to be filled with the counters
+ */
+void iosched_get_stats(struct iosched *sched, struct iosched_stats *stats);
+
+#endif /* _IOSCHED_H */